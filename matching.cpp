@@ -6,8 +6,25 @@
 #include <chrono>
 #include <unordered_map>
 #include <set>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <numbers>
+#include <cmath>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <numeric>
+#include <bit>
+#include <random>
+#include <unistd.h>
 #include <cstring>
 #include <format>
+#include <stdexcept>
 
 // ROOT libraries include
 #include "TFile.h"
@@ -15,6 +32,7 @@
 #include "TTree.h"
 #include "TChain.h"
 #include "TChainIndex.h"
+#include "TChainElement.h"
 #include "TTreeReader.h"
 #include "TTreeReaderValue.h"
 #include "TTreeReaderArray.h"
@@ -22,9 +40,15 @@
 #include "TObject.h"
 #include "TBranch.h"
 #include "TLeaf.h"
+#include "TLeafI.h"
 #include "TBranchElement.h"
 #include "TLeafElement.h"
 #include "TROOT.h"
+#include "TRegexp.h"
+#include "Compression.h"
+#include "ROOT/RVec.hxx"
+
+#include "matching.h"
 
 // input parameters
 // std::string datasetA_filelist_filename = "filelist_test1.txt";
@@ -47,6 +71,43 @@ std::string datasetB_filelist_filename = "filelist2.txt";
 std::string datasetA_branchname_prefix = "1.";
 std::string datasetB_branchname_prefix = "2.";
 
+// batch mode parameters, replace the input parameters above
+// the reference dataset is indexed once, then each probe job scans its own dataset against the shared, read-only index
+// each job writes <out_directory>/<out_filename_prefix>.root with the reference and probe trees, as in the default mode
+bool use_batch_mode = false;
+std::string reference_filelist_filename = "filelist1.txt";
+std::string reference_branchname_prefix = "1.";
+struct probe_job {
+    std::string filelist_filename;
+    std::string branchname_prefix;
+    std::string out_directory;
+    std::vector<std::string> branch_patterns; // SetBranchStatus patterns on both datasets, empty for all branches
+};
+std::vector<probe_job> probe_jobs = {
+    // {"filelist2.txt", "2.", "output/2", {}},
+    // {"filelist3.txt", "3.", "output/3", {"nJet", "Jet_*"}},
+};
+int probe_num_concurrent_jobs = 1; // 1 to run jobs one after another, dry runs always run one after another
+
+// startup parameters
+int startup_num_threads = 16; // files opened concurrently to read metadata, 0 to leave it to TChain one file at a time
+bool prune_files_without_run_overlap = true; // drop files whose run range does not overlap any file of the other dataset
+
+// index parameters
+// the compact index stores each run's sorted event numbers and their entry numbers bit-packed in blocks, a few bytes per entry
+// instead of the full 64-bit keys and entry numbers of TChainIndex, lookups binary search the run directory, then the blocks of the run
+bool use_compact_index = false;
+int compact_index_block_size = 128; // events per block, at most 65535
+
+// staging parameters, copies input files to local scratch in the background
+// the long chain is read in order, so the next files are staged ahead and deleted once passed
+// the short chain is read randomly through the index, so its files are staged on first use and evicted least recently used
+bool use_staging = false;
+std::string staging_directory = "/tmp/nanoaod_matching_staging";
+int staging_num_files_ahead = 4;
+int staging_num_threads = 2; // concurrent copies per chain
+Long64_t staging_max_size = 20000000000LL; // 20 GB disk budget per chain
+
 // output parameters
 std::string out_directory = "output";
 std::string out_filename_prefix = "merge_nano";
@@ -55,29 +116,282 @@ Long64_t out_tree_max_size = 500000000LL; // 500 MB before compression
 //Long64_t out_tree_max_size = 5000000LL;
 // Long64_t out_tree_max_num_entries = 100000;
 
+// output compression parameters
+// algorithm and level for output files, used by every branch without a matching rule below
+ROOT::RCompressionSetting::EAlgorithm::EValues out_compression_algorithm = ROOT::RCompressionSetting::EAlgorithm::kZSTD;
+int out_compression_level = 5;
+// per-branch overrides, matched against the input branch name (without prefix), first matching rule wins
+struct branch_compression_rule {
+    std::string branchname_pattern; // wildcard pattern, same syntax as SetBranchStatus
+    ROOT::RCompressionSetting::EAlgorithm::EValues algorithm;
+    int level;
+};
+std::vector<branch_compression_rule> out_branch_compression_rules = {
+    // {"Jet_*", ROOT::RCompressionSetting::EAlgorithm::kLZ4, 4}, // hot kinematic branches
+    // {"HLT_*", ROOT::RCompressionSetting::EAlgorithm::kLZMA, 8}, // rarely read branches
+};
+// basket size and auto-flush are derived from the bytes per entry observed in the input branches
+Long64_t out_cluster_target_size = 30000000LL; // 30 MB before compression per cluster
+Int_t out_basket_min_size = 4096;
+Int_t out_basket_max_size = 1048576;
+
+// event filter parameters
+// filters are compiled C++ predicates, built once on the reader of their dataset. They are evaluated on the key pass
+// right after a match is found, and only branches declared on the reader are read, the full entry is read only if all pass.
+// e.g. require at least two jets in datasetA
+// event_filter_builder datasetA_filter = [](TTreeReader& reader) -> event_filter {
+//     auto num_jets = std::make_shared<TTreeReaderValue<UInt_t>>(reader, "nJet");
+//     return [num_jets]() { return **num_jets >= 2; };
+// };
+event_filter_builder datasetA_filter = nullptr;
+event_filter_builder datasetB_filter = nullptr;
+joined_event_filter_builder joined_filter = nullptr;
+
+// deduplication parameters (merged mode only)
+// branches byte-identical in both datasets are written once under the datasetA name, with an alias for the datasetB name
+bool use_deduplication = false;
+Long64_t dedup_sample_size = 1000; // matched events
+Long64_t dedup_sample_max_entries = 100000; // long chain entries scanned for the sample
+
+// object matching parameters (merged mode only)
+// each object is matched to the nearest object of the other dataset within max_delta_r, optionally requiring
+// pt ratio (datasetB object / datasetA object) within [min_pt_ratio, max_pt_ratio]. Matching is not exclusive.
+// writes <prefix><collection>_matchIdx (index in the other collection, -1 if none) and <prefix><collection>_matchDeltaR
+struct collection_match_rule {
+    std::string datasetA_collection; // e.g. "Jet", needs <collection>_pt, _eta, _phi and n<collection>
+    std::string datasetB_collection;
+    Float_t max_delta_r;
+    Float_t min_pt_ratio; // <= 0 to disable
+    Float_t max_pt_ratio; // <= 0 to disable
+};
+std::vector<collection_match_rule> collection_match_rules = {
+    // {"Jet", "Jet", 0.4, 0., 0.},
+    // {"Muon", "Muon", 0.1, 0.5, 2.},
+};
+
+// planner parameters
+// the indexed dataset is chosen by estimated bytes decompressed, otherwise the dataset with fewer entries is indexed
+bool use_cost_based_planner = true;
+Long64_t planner_sample_size = 1000; // entries of the first file read for key sortedness
+
+// dry run parameters
+// only run, event and basket metadata are read, nothing is written: matches per run, output size and key pass time
+bool dry_run = false;
+Long64_t dry_run_sample_size = 0; // first matched events read in full to project the copy time, 0 to skip
+
 // debugging parameters
 int verbose = 3;
 float print_every_percent = 0.1;
 
 // helper function defintion
-TChain* build_chain(std::string filelist_filename, int& num_files);
+struct file_metadata {
+    std::string filename;
+    bool is_scanned = false; // metadata below is only filled if scanned
+    bool is_valid = true;
+    bool is_pruned = false; // no run overlap with the other dataset, left out of the chain
+    Long64_t num_entries = TChain::kBigNumber; // unknown unless scanned
+    Long64_t file_size = 0; // bytes
+    std::vector<std::string> branch_names;
+    std::unordered_map<std::string, Int_t> counter_maxima; // counter branch name -> maximum
+    UInt_t min_run = 0;
+    UInt_t max_run = 0;
+};
+std::vector<file_metadata> scan_filelist(const std::string& filelist_filename);
+void read_file_metadata(file_metadata& metadata);
+void prune_files_by_run_range(std::vector<file_metadata>& files, const std::vector<file_metadata>& other_files);
+std::unordered_map<std::string, Int_t> get_counter_maxima(const std::vector<file_metadata>& files);
+void build_input_chains(const std::string& datasetA_filelist_filename, const std::string& datasetB_filelist_filename, TChain*& datasetA_chain, TChain*& datasetB_chain, int& datasetA_num_files, int& datasetB_num_files, std::unordered_map<std::string, Int_t>& datasetA_counter_maxima, std::unordered_map<std::string, Int_t>& datasetB_counter_maxima, std::vector<file_metadata>* datasetA_files_out = nullptr, std::vector<file_metadata>* datasetB_files_out = nullptr);
+TChain* build_chain(const std::vector<file_metadata>& files, int& num_files);
+Long64_t get_unpruned_num_entries(TChain *chain, const std::vector<file_metadata>& files);
 void* allocate_memory_from_leaf(const char* leaf_type_name, bool singleton, Int_t length);
-void append_branches_from_tree(TTree *src_tree, TTree *dst_tree, std::unordered_map<std::string, void*>& data_addresses, const std::string& prefix);
+char get_leaf_type_code(const char* leaf_type_name);
+void append_branches_from_tree(TTree *src_tree, TTree *dst_tree, std::unordered_map<std::string, void*>& data_addresses, const std::string& prefix, const std::unordered_map<std::string, Int_t>* counter_maxima = nullptr);
 void reallocate_memory_if_any(TTree *src_tree, TTree *dst_tree, std::unordered_map<std::string, void*>& data_addresses, const std::string& prefix);
 void deallocate_memory_from_leaf(const char* leaf_type_name, void* addr);
 Long64_t get_tree_byte_size(TTree* tree);
+void deallocate_branch_memory(TTree *dst_tree, std::unordered_map<std::string, void*>& data_addresses);
+std::string get_dst_branch_name(const char* src_branch_name, const std::string& prefix);
+Double_t get_tree_bytes_per_entry(TTree *src_tree, bool is_compressed = false);
+Long64_t get_cluster_num_entries(Double_t bytes_per_entry);
+Int_t get_branch_compression_settings(const std::string& branch_name); // input branch name without prefix
+void configure_output_branches(TTree *src_tree, TTree *dst_tree, const std::string& prefix, Long64_t cluster_num_entries);
+
+void build_event_filters(TTreeReader& long_chain_reader, TTreeReader& short_chain_reader, bool is_swapped, event_filter& long_chain_filter, event_filter& short_chain_filter, event_filter& joined_chain_filter);
+bool pass_event_filters(const event_filter& long_chain_filter, const event_filter& short_chain_filter, const event_filter& joined_chain_filter);
+
+struct collection_match_state {
+    collection_match_rule rule;
+    std::string datasetA_collection_name; // prefixed, e.g. 1.Jet
+    std::string datasetB_collection_name;
+    TLeaf *datasetA_counter_leaf;
+    TLeaf *datasetB_counter_leaf;
+    std::vector<Int_t> datasetA_match_idx, datasetB_match_idx;
+    std::vector<Float_t> datasetA_match_delta_r, datasetB_match_delta_r;
+    std::vector<Float_t> delta_r2; // scratch, datasetA objects x datasetB objects
+};
+std::vector<collection_match_state> append_collection_match_branches(TTree *dst_tree, const std::unordered_map<std::string, void*>& data_addresses);
+void match_collections(collection_match_state& state, const std::unordered_map<std::string, void*>& data_addresses, TTree *out_tree_base, TTree *out_tree);
+void compute_delta_r_matches(const Float_t* datasetA_pt, const Float_t* datasetA_eta, const Float_t* datasetA_phi, Int_t datasetA_num_objects, const Float_t* datasetB_pt, const Float_t* datasetB_eta, const Float_t* datasetB_phi, Int_t datasetB_num_objects, const collection_match_rule& rule, Float_t* delta_r2, Int_t* datasetA_match_idx, Float_t* datasetA_match_delta_r, Int_t* datasetB_match_idx, Float_t* datasetB_match_delta_r);
+
+// sorted (run, event) -> entry lookup, read-only after build so it can be shared between threads
+// with use_compact_index, each run of the sorted keys is stored in blocks of bit-packed event and entry numbers.
+// Building holds the keys once, 24 bytes per entry reserved from the entry count and sorted in place, plus the packed blocks
+// while they are encoded, the keys are then released
+class event_index {
+public:
+    struct index_entry {
+        UInt_t run;
+        ULong64_t event_number;
+        Long64_t entry_number;
+    };
+    void build(TChain *chain); // reads only run and event
+    void build(std::vector<index_entry> keys); // keys already read, in any order
+    Long64_t get_entry_number(UInt_t run, ULong64_t event_number) const; // -1 if not found
+    Long64_t size() const { return num_entries; }
+    Long64_t get_num_bytes() const;
+private:
+    std::vector<index_entry> entries;
+    Long64_t num_entries = 0;
+
+    // compact layout, frame of reference per block: values are stored as offsets from the block's first event number and smallest entry number
+    struct run_entry {
+        UInt_t run;
+        UInt_t first_block; // blocks of this run end at the first block of the next run
+    };
+    struct block_header {
+        Long64_t first_entry_number; // smallest entry number in the block
+        ULong64_t bit_offset; // event number offsets, then entry number offsets
+        UShort_t num_events;
+        UChar_t event_number_width; // bits
+        UChar_t entry_number_width;
+    };
+    std::vector<run_entry> runs;
+    std::vector<ULong64_t> block_first_event_numbers; // separate from headers, binary searched
+    std::vector<block_header> blocks;
+    std::vector<ULong64_t> packed_words;
+    ULong64_t num_bits = 0;
+    bool is_compact = false;
+    Long64_t get_compact_entry_number(UInt_t run, ULong64_t event_number) const;
+    void append_packed(ULong64_t value, int width);
+    ULong64_t read_packed(ULong64_t bit_offset, int width) const;
+};
+Long64_t get_entry_number_with_index(TChain *chain, const event_index *index, UInt_t run, ULong64_t event_number);
+#ifdef NANOAOD_MATCHING_SELF_CHECK
+bool check_event_index(); // see matching_check in Makefile
+bool check_delta_r_matches();
+#endif
+
+struct block_column {
+    std::vector<char> data; // rows in the order they are read
+    std::vector<size_t> row_offsets; // per row in block order
+    std::vector<size_t> row_sizes; // bytes
+};
+class file_stager;
+void read_block_columns(TChain *chain, const std::vector<Long64_t>& entries, const std::string& prefix, std::unordered_map<std::string, block_column>& columns, Int_t& saved_tree_number, TTree *out_tree_base, TTree *out_tree, std::unordered_map<std::string, void*>& data_addresses, file_stager *stager);
+Long64_t write_block_columns(TTree *out_tree, std::unordered_map<std::string, block_column>& columns, std::unordered_map<std::string, void*>& data_addresses, std::vector<collection_match_state>& collection_match_states, TTree *out_tree_base, Long64_t num_rows);
+void restore_block_row(const block_column& column, Long64_t row, void* data_addr);
+
+struct shared_column {
+    std::string kept_branch_name; // datasetA name, written
+    std::string aliased_branch_name; // datasetB name, alias of kept_branch_name
+    std::string kept_counter_name; // empty if singleton
+    std::string aliased_counter_name;
+    Int_t type_size; // bytes per element
+    bool is_shared = true;
+};
+std::vector<shared_column> find_shared_columns(TChain *long_chain, TChain *short_chain, const std::string& long_chain_branchname_prefix, const std::string& short_chain_branchname_prefix, bool is_swapped, const event_index *short_chain_index, std::unordered_map<std::string, void*>& data_addresses, TTree *out_tree_base, Int_t& long_chain_saved_tree_number, Int_t& short_chain_saved_tree_number);
+Int_t check_shared_columns(std::vector<shared_column>& shared_columns, const std::unordered_map<std::string, void*>& data_addresses);
+Int_t check_shared_columns_in_block(std::vector<shared_column>& shared_columns, const std::unordered_map<std::string, block_column>& columns, Long64_t num_rows);
+void add_diverged_branches(TTree *out_tree, TTree *out_tree_base, const std::vector<shared_column>& shared_columns, std::unordered_map<std::string, void*>& data_addresses);
+TTree* clone_out_tree(TTree *out_tree_base, const std::vector<shared_column>& shared_columns);
+
+class file_stager {
+public:
+    file_stager(TChain *chain, const std::string& staging_subdirectory, bool is_sequential, const std::vector<file_metadata>& files_metadata);
+    ~file_stager();
+    // call from the main loop with the chain's current tree number, applies finished copies and schedules new ones
+    void update(Int_t tree_number);
+private:
+    enum class stage_status { kNotStaged, kQueued, kCopying, kReady, kFailed };
+    struct staged_file {
+        std::string original_path;
+        std::string staged_path;
+        stage_status status = stage_status::kNotStaged;
+        Long64_t size = 0; // reserved or actual bytes on disk
+        Long64_t expected_size = 0; // source size, reserved before the copy starts
+        Long64_t last_used = 0;
+        bool is_redirected = false; // chain element points to the staged copy
+    };
+    TChain *chain;
+    bool is_sequential;
+    std::string staging_path;
+    std::vector<staged_file> files;
+    std::deque<Int_t> queue;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::atomic<bool> has_finished_copies{false};
+    bool is_stopping = false;
+    Int_t current_tree_number = -1;
+    Long64_t num_updates = 0;
+    Long64_t staged_size = 0;
+    void copy_worker();
+    bool schedule(Int_t tree_number);
+    void evict(Int_t tree_number);
+};
+
+struct probe_result {
+    Long64_t num_entries = 0;
+    Long64_t num_match = 0;
+    Long64_t num_filtered = 0;
+    std::chrono::duration<double> elapsed_time{0};
+};
+probe_result run_probe_job(const probe_job& job, int job_index, const event_index& reference_index, const std::vector<file_metadata>& reference_files, const std::vector<file_metadata>& probe_files);
+probe_result copy_matched_events(TChain *long_chain, TChain *short_chain, const event_index *short_chain_index, const std::string& long_chain_branchname_prefix, const std::string& short_chain_branchname_prefix, bool is_swapped,
+                                 const std::vector<file_metadata>& long_chain_files, const std::vector<file_metadata>& short_chain_files, const std::string& out_directory_path, const std::string& staging_suffix, bool is_progress_printed);
+
+struct dataset_profile {
+    Long64_t num_entries = 0;
+    Double_t zip_bytes_per_entry = 0; // active branches
+    Double_t key_zip_bytes_per_entry = 0; // run and event
+    Long64_t cluster_num_entries = 1;
+    Double_t sortedness = 0; // key order of the first entries, 0 for random and 1 for sorted
+    Long64_t num_sampled_entries = 0; // first entries of the first file read for sortedness
+};
+struct matching_plan {
+    bool is_swapped = false; // datasetA is probed, datasetB is indexed
+    Double_t expected_num_match = 0;
+    Double_t cost = 0; // estimated bytes decompressed
+    Double_t entries_rule_cost = 0; // the dataset with fewer entries indexed
+};
+dataset_profile get_dataset_profile(TChain *chain);
+Double_t get_expected_num_match(const std::vector<file_metadata>& datasetA_files, const std::vector<file_metadata>& datasetB_files, Long64_t datasetA_num_entries, Long64_t datasetB_num_entries);
+Double_t get_matching_cost(const dataset_profile& indexed, const dataset_profile& probed, Double_t num_match, bool is_indexed_order, Long64_t block_size);
+matching_plan plan_matching(TChain *datasetA_chain, TChain *datasetB_chain, const std::vector<file_metadata>& datasetA_files, const std::vector<file_metadata>& datasetB_files, bool is_merged);
+
+Long64_t estimate_matching(TChain *long_chain, TChain *short_chain, const event_index *short_chain_index, const std::vector<file_metadata>& long_chain_files, const std::vector<file_metadata>& short_chain_files, bool is_swapped, bool is_merged, std::chrono::duration<double> index_elapsed_time); // returns number of matches
 
 void match_trees_no_merged();
 void match_trees_merged();
+void match_trees_batch();
 
-// main
+// main, left out when built as a library
+#if defined(NANOAOD_MATCHING_SELF_CHECK)
+int main() {
+    bool is_passed = check_event_index();
+    is_passed = check_delta_r_matches() && is_passed;
+    return is_passed ? 0 : 1;
+}
+#elif !defined(NANOAOD_MATCHING_NO_MAIN)
 int main() {
     ROOT::DisableImplicitMT();
 
-    match_trees_no_merged();
+    if (use_batch_mode) match_trees_batch();
+    else match_trees_no_merged();
 
     return 0;
 }
+#endif
 
 void match_trees_no_merged() {
     if (verbose >= 2) std::cout << "Start setting up..." << std::endl;
@@ -91,26 +405,19 @@ void match_trees_no_merged() {
     if (verbose >= 2) std::cout << "Start building input chains..." << std::endl;
     int short_chain_num_files = 0;
     int long_chain_num_files = 0;
-    TChain *short_chain = build_chain(datasetA_filelist_filename, short_chain_num_files);
-    TChain *long_chain = build_chain(datasetB_filelist_filename, long_chain_num_files);
+    TChain *short_chain = nullptr;
+    TChain *long_chain = nullptr;
+    std::unordered_map<std::string, Int_t> short_chain_counter_maxima, long_chain_counter_maxima;
+    std::vector<file_metadata> datasetA_files, datasetB_files;
+    build_input_chains(datasetA_filelist_filename, datasetB_filelist_filename, short_chain, long_chain, short_chain_num_files, long_chain_num_files, short_chain_counter_maxima, long_chain_counter_maxima, &datasetA_files, &datasetB_files);
     std::string short_chain_branchname_prefix = datasetA_branchname_prefix;
     std::string long_chain_branchname_prefix = datasetB_branchname_prefix;
     Long64_t short_chain_num_entries = short_chain->GetEntries();
     Long64_t long_chain_num_entries = long_chain->GetEntries();
-    Long64_t datasetA_num_entries = short_chain_num_entries;
-    Long64_t datasetB_num_entries = long_chain_num_entries;
+    Long64_t datasetA_num_entries = get_unpruned_num_entries(short_chain, datasetA_files);
+    Long64_t datasetB_num_entries = get_unpruned_num_entries(long_chain, datasetB_files);
     if (verbose >= 2) std::cout << "Finish building input chains..." << std::endl;
 
-    // swap chain if first chain is longer than the second chain
-    if (short_chain_num_entries > long_chain_num_entries) {
-        if (verbose >= 3) std::cout << "Swapping input chains" << std::endl;
-        std::swap(short_chain, long_chain);
-        std::swap(short_chain_branchname_prefix, long_chain_branchname_prefix);
-        std::swap(short_chain_num_files, long_chain_num_files);
-        std::swap(short_chain_num_entries, long_chain_num_entries);
-        std::swap(datasetA_num_entries, datasetB_num_entries);
-    }
-
     // set active branches
     short_chain->SetBranchStatus("*", false);
     long_chain->SetBranchStatus("*", false);
@@ -135,12 +442,29 @@ void match_trees_no_merged() {
     short_chain->SetBranchStatus("event", true); 
     long_chain->SetBranchStatus("run", true); 
     long_chain->SetBranchStatus("event", true); 
+
+    // choose the indexed (short) chain, on the active branches; swap chain if datasetA is to be probed
+    matching_plan plan = plan_matching(short_chain, long_chain, datasetA_files, datasetB_files, false);
+    bool is_swapped = false;
+    if (plan.is_swapped) {
+        if (verbose >= 3) std::cout << "Swapping input chains" << std::endl;
+        is_swapped = true;
+        std::swap(short_chain, long_chain);
+        std::swap(short_chain_branchname_prefix, long_chain_branchname_prefix);
+        std::swap(short_chain_num_files, long_chain_num_files);
+        std::swap(short_chain_counter_maxima, long_chain_counter_maxima);
+        std::swap(short_chain_num_entries, long_chain_num_entries);
+        std::swap(datasetA_num_entries, datasetB_num_entries);
+    }
     if (verbose >= 2) std::cout << "Finish setting up..." << std::endl;
 
     // build lookup indices for short chain
     if (verbose >= 1) std::cout << "Start building lookup indices with " << short_chain->GetEntries() << " entries..." << std::endl;
     saved_time = stopwatch.now();
-    short_chain->BuildIndex("run", "event");
+    event_index short_chain_compact_index;
+    if (use_compact_index) short_chain_compact_index.build(short_chain);
+    else short_chain->BuildIndex("run", "event");
+    const event_index *short_chain_index = use_compact_index ? &short_chain_compact_index : nullptr; // nullptr for the TChainIndex
     current_time = stopwatch.now();
     elapsed_time = current_time - saved_time;
     if (verbose >= 1) std::cout << "Finish building lookup indices with " << short_chain_num_entries << " entries..." << std::endl;
@@ -148,8 +472,15 @@ void match_trees_no_merged() {
     std::cout << std::format("{:=^75}", "SUMMARY: Building Lookup indices") << std::endl;
     std::cout << std::format("Total time: {:%T}", elapsed_time) << std::endl;
     std::cout << std::format("Average time per entry: {:.05f} ms", elapsed_time.count() * 1000 / short_chain_num_entries) << std::endl;
+    if (short_chain_index) std::cout << std::format("Index size: {:.03f} MB ({:.02f} bytes per entry)", short_chain_index->get_num_bytes() / 1e6, Double_t(short_chain_index->get_num_bytes()) / std::max<Long64_t>(short_chain_index->size(), 1)) << std::endl;
     std::cout << std::format("{:=^75}", "") << std::endl;
 
+    // estimate from the keys and a sample of full reads, nothing is written
+    if (dry_run){
+        estimate_matching(long_chain, short_chain, short_chain_index, is_swapped ? datasetA_files : datasetB_files, is_swapped ? datasetB_files : datasetA_files, is_swapped, false, elapsed_time);
+        return;
+    }
+
     // set up output directory
     if (verbose >= 3) std::cout << "Start preparing output directory..." << std::endl;
     out_directory = (out_directory[out_directory.length()-1] != '/') ? out_directory : out_directory.substr(0, out_directory.length()-1); // remove tailing slash if any
@@ -158,6 +489,32 @@ void match_trees_no_merged() {
     // for testing
     //int max_entries = 100;
 
+    // probe the long chain and copy matched events
+    probe_result result = copy_matched_events(long_chain, short_chain, short_chain_index, long_chain_branchname_prefix, short_chain_branchname_prefix, is_swapped,
+                                              is_swapped ? datasetA_files : datasetB_files, is_swapped ? datasetB_files : datasetA_files, out_directory, "", true);
+    Long64_t num_match = result.num_match;
+    Long64_t num_filtered = result.num_filtered;
+    elapsed_time = result.elapsed_time;
+
+    // print summary
+    std::cout << std::format("{:=^75}", "SUMMARY: Matching Trees") << std::endl;
+    std::cout << std::format("Total time: {:%T}", elapsed_time) << std::endl;
+    std::cout << std::format("Average time per entry: {:.05f} ms", elapsed_time.count() * 1000 / long_chain_num_entries) << std::endl;
+    // matched events before filters, as without filters, then the ones passing filters
+    Long64_t num_raw_match = num_match + num_filtered;
+    std::cout << "Number of matched events: " << num_raw_match << std::endl;
+    std::cout << TString::Format("Percent matched events from datasetA: %lld/%lld (%.03f%%)", num_raw_match, datasetA_num_entries, Double_t(num_raw_match)/datasetA_num_entries * 100) << std::endl;
+    std::cout << TString::Format("Percent matched events from datasetB: %lld/%lld (%.03f%%)", num_raw_match, datasetB_num_entries, Double_t(num_raw_match)/datasetB_num_entries * 100) << std::endl;
+    if (datasetA_filter || datasetB_filter || joined_filter){
+        std::cout << "Number of matched events passing filters: " << num_match << " (" << num_filtered << " rejected)" << std::endl;
+        std::cout << TString::Format("Percent matched events passing filters from datasetA: %lld/%lld (%.03f%%)", num_match, datasetA_num_entries, Double_t(num_match)/datasetA_num_entries * 100) << std::endl;
+        std::cout << TString::Format("Percent matched events passing filters from datasetB: %lld/%lld (%.03f%%)", num_match, datasetB_num_entries, Double_t(num_match)/datasetB_num_entries * 100) << std::endl;
+    }
+    std::cout << std::format("{:=^75}", "") << std::endl;
+}
+
+probe_result copy_matched_events(TChain *long_chain, TChain *short_chain, const event_index *short_chain_index, const std::string& long_chain_branchname_prefix, const std::string& short_chain_branchname_prefix, bool is_swapped,
+                                 const std::vector<file_metadata>& long_chain_files, const std::vector<file_metadata>& short_chain_files, const std::string& out_directory_path, const std::string& staging_suffix, bool is_progress_printed){
     // set up reader
     if (verbose >= 2) std::cout << "Start building treereader..." << std::endl;
     TTreeReader long_chain_reader(long_chain);
@@ -171,6 +528,22 @@ void match_trees_no_merged() {
     //TTreeReaderValue<UInt_t> *short_chain_run = new TTreeReaderValue<UInt_t>(short_chain_reader, "run");
     //TTreeReaderValue<ULong64_t> *short_chain_event_number = new TTreeReaderValue<ULong64_t>(short_chain_reader, "event");
 
+    // stage input files to local scratch in the background
+    std::unique_ptr<file_stager> long_chain_stager, short_chain_stager;
+    if (use_staging){
+        long_chain_stager = std::make_unique<file_stager>(long_chain, "long" + staging_suffix, true, long_chain_files);
+        short_chain_stager = std::make_unique<file_stager>(short_chain, "short" + staging_suffix, false, short_chain_files);
+    }
+
+    // build event filters on the readers, these only read their predicate branches
+    event_filter long_chain_filter, short_chain_filter, joined_chain_filter;
+    build_event_filters(long_chain_reader, short_chain_reader, is_swapped, long_chain_filter, short_chain_filter, joined_chain_filter);
+
+    // open output file first, so baskets are flushed with per-branch compression settings while filling
+    //TString out_file_path = TString::Format("%s/%s_%d.root", out_directory.c_str(), out_filename_prefix.c_str(), out_file_index);
+    TString out_file_path = TString::Format("%s/%s.root", out_directory_path.c_str(), out_filename_prefix.c_str());
+    TFile *out_file = TFile::Open(out_file_path.Data(), "RECREATE", "", ROOT::CompressionSettings(out_compression_algorithm, out_compression_level));
+
     // clone for out trees
     if (verbose >= 2) std::cout << "Start building output trees..." << std::endl;
     //auto out_long_tree = long_chain->GetTree()->CloneTree(0);
@@ -179,10 +552,29 @@ void match_trees_no_merged() {
     out_long_tree->SetName((long_chain_branchname_prefix + "Events").c_str());
     auto out_short_tree = short_chain->CloneTree(0);
     out_short_tree->SetName((short_chain_branchname_prefix + "Events").c_str());
+
+    // tune compression, basket size and auto-flush from input bytes per entry
+    Long64_t out_long_tree_cluster_num_entries = get_cluster_num_entries(get_tree_bytes_per_entry(long_chain));
+    Long64_t out_short_tree_cluster_num_entries = get_cluster_num_entries(get_tree_bytes_per_entry(short_chain));
+    configure_output_branches(long_chain, out_long_tree, "", out_long_tree_cluster_num_entries);
+    configure_output_branches(short_chain, out_short_tree, "", out_short_tree_cluster_num_entries);
+    out_long_tree->SetAutoFlush(out_long_tree_cluster_num_entries);
+    out_short_tree->SetAutoFlush(out_short_tree_cluster_num_entries);
+    if (verbose >= 2) std::cout << "Output cluster size: " << out_long_tree_cluster_num_entries << "/" << out_short_tree_cluster_num_entries << " entries" << std::endl;
+    out_long_tree->SetDirectory(out_file);
+    out_short_tree->SetDirectory(out_file);
     if (verbose >= 2) std::cout << "Finish building output trees..." << std::endl;
 
     // loop parameter
-    Long64_t num_match = 0;
+    probe_result result;
+    Long64_t& num_match = result.num_match;
+    Long64_t& num_filtered = result.num_filtered;
+    Long64_t long_chain_num_entries = long_chain->GetEntries();
+    Long64_t short_chain_num_entries = short_chain->GetEntries();
+    Long64_t long_chain_unpruned_num_entries = get_unpruned_num_entries(long_chain, long_chain_files);
+    Long64_t short_chain_unpruned_num_entries = get_unpruned_num_entries(short_chain, short_chain_files);
+    Long64_t datasetA_num_entries = is_swapped ? long_chain_unpruned_num_entries : short_chain_unpruned_num_entries;
+    Long64_t datasetB_num_entries = is_swapped ? short_chain_unpruned_num_entries : long_chain_unpruned_num_entries;
     Long64_t out_tree_current_num_entries = 0;
     Long64_t out_tree_current_size = 0;
 
@@ -192,19 +584,29 @@ void match_trees_no_merged() {
 
     // loop over entries and copy over to output tree
     if (verbose >= 1) std::cout << "Start looping over " << long_chain_num_entries << " entries..." << std::endl;
-    saved_time = stopwatch.now();
+    std::chrono::steady_clock stopwatch;
+    auto saved_time = stopwatch.now();
     while (long_chain_reader.Next()) {
         // get current entry in the long chain
         Long64_t i_long_chain = long_chain_reader.GetCurrentEntry();
+        if (long_chain_stager) long_chain_stager->update(long_chain->GetTreeNumber());
 
         // search for corresponding event in the short chain
-        Long64_t i_short_chain = short_chain->GetEntryNumberWithIndex(*long_chain_run, *long_chain_event_number);
+        Long64_t i_short_chain = get_entry_number_with_index(short_chain, short_chain_index, *long_chain_run, *long_chain_event_number);
+
+        // evaluate filters before reading the full entries
+        if (i_short_chain != -1){
+            short_chain_reader.SetEntry(i_short_chain);
+            if (short_chain_stager) short_chain_stager->update(short_chain->GetTreeNumber());
+            if (!pass_event_filters(long_chain_filter, short_chain_filter, joined_chain_filter)){
+                num_filtered++;
+                i_short_chain = -1;
+            }
+        }
         
         if (i_short_chain != -1){ // found match
             num_match++; 
             out_tree_current_num_entries++;
-
-            short_chain_reader.SetEntry(i_short_chain);
             //std::cout << std::format("{} {} {} {}", *long_chain_run, **short_chain_run, *long_chain_event_number, **short_chain_event_number)<< std::endl;
 
             // read all branches for this entry
@@ -223,9 +625,8 @@ void match_trees_no_merged() {
             } 
 
             // printing
-            if ((verbose >= 1) && (((num_match == 5) && (i_long_chain+1 < print_every_entries)) || ((i_long_chain+1) % print_every_entries) == 0)){
-                current_time = stopwatch.now();
-                elapsed_time = current_time - saved_time;
+            if (is_progress_printed && (verbose >= 1) && (((num_match == 5) && (i_long_chain+1 < print_every_entries)) || ((i_long_chain+1) % print_every_entries) == 0)){
+                std::chrono::duration<double> elapsed_time = stopwatch.now() - saved_time;
                 // tqdm style
                 //std::cout << std::format("{:06.02f}", elapsed_time.count());
                 std::cout << "#process: " << std::setw(long_chain_num_entries_num_digits) << std::left << i_long_chain+1 << "/" << long_chain_num_entries;
@@ -239,30 +640,386 @@ void match_trees_no_merged() {
         } // if match 
     } // loop long chain
 
-    current_time = stopwatch.now();
-    elapsed_time = current_time - saved_time;
+    result.num_entries = long_chain_unpruned_num_entries;
+    result.elapsed_time = stopwatch.now() - saved_time;
     if (verbose >= 1) std::cout << "Finishing looping over " << long_chain_num_entries << " entries..." << std::endl;
 
     // write to file
-    //TString out_file_path = TString::Format("%s/%s_%d.root", out_directory.c_str(), out_filename_prefix.c_str(), out_file_index);
-    TString out_file_path = TString::Format("%s/%s.root", out_directory.c_str(), out_filename_prefix.c_str());
     if (verbose >= 2) std::cout << "Saving to file " << out_file_path << std::endl;
-    TFile *out_file = TFile::Open(out_file_path.Data(), "RECREATE");
     out_file->cd();
     out_long_tree->Write();
     out_short_tree->Write();
-    out_file->Close();
+    out_file->Close(); // output trees are owned and deleted by out_file
+    delete out_file;
+
+    // stagers restore chain elements, so release them before the caller deletes the chains
+    long_chain_stager.reset();
+    short_chain_stager.reset();
+    return result;
+}
+
+dataset_profile get_dataset_profile(TChain *chain){
+    dataset_profile profile;
+    profile.num_entries = chain->GetEntries();
+    if (profile.num_entries == 0) return profile;
+
+    // sizes and cluster layout from the first file
+    chain->LoadTree(0);
+    TTree* this_tree = chain->GetTree();
+    profile.zip_bytes_per_entry = get_tree_bytes_per_entry(chain, true);
+    for (const char* key_branch_name : {"run", "event"}){
+        TBranch* key_branch = this_tree->GetBranch(key_branch_name);
+        if (key_branch) profile.key_zip_bytes_per_entry += Double_t(key_branch->GetZipBytes()) / this_tree->GetEntries();
+    }
+    auto cluster_iterator = this_tree->GetClusterIterator(0);
+    Long64_t cluster_start_entry = cluster_iterator.Next();
+    profile.cluster_num_entries = std::clamp<Long64_t>(cluster_iterator.GetNextEntry() - cluster_start_entry, 1, this_tree->GetEntries());
+
+    // key sortedness on the first entries of the first file, only run and event are read, rescaled so that random order is 0 and sorted is 1
+    profile.num_sampled_entries = std::min(planner_sample_size, this_tree->GetEntries());
+    TTreeReader reader(chain);
+    reader.SetEntriesRange(0, profile.num_sampled_entries);
+    TTreeReaderValue<UInt_t> run(reader, "run");
+    TTreeReaderValue<ULong64_t> event_number(reader, "event");
+    Long64_t num_pairs = 0, num_sorted_pairs = 0;
+    std::pair<UInt_t, ULong64_t> previous_key;
+    while (reader.Next()){
+        std::pair<UInt_t, ULong64_t> key(*run, *event_number);
+        if (reader.GetCurrentEntry() > 0){
+            num_pairs++;
+            if (key >= previous_key) num_sorted_pairs++;
+        }
+        previous_key = key;
+    }
+    if (num_pairs > 0) profile.sortedness = std::max(0., 2. * num_sorted_pairs / num_pairs - 1);
+    return profile;
+}
+
+Double_t get_expected_num_match(const std::vector<file_metadata>& datasetA_files, const std::vector<file_metadata>& datasetB_files, Long64_t datasetA_num_entries, Long64_t datasetB_num_entries){
+    // at most every event of the smaller dataset, also when run ranges are unknown
+    Double_t max_num_match = std::min(datasetA_num_entries, datasetB_num_entries);
+    auto is_scanned = [](const file_metadata& metadata){ return metadata.is_scanned; };
+    if (!std::all_of(datasetA_files.begin(), datasetA_files.end(), is_scanned) || !std::all_of(datasetB_files.begin(), datasetB_files.end(), is_scanned)) return max_num_match;
+
+    // run range intersection of every file pair, each file's entries spread evenly over its run range
+    auto get_num_runs = [](Long64_t min_run, Long64_t max_run){ return std::max<Long64_t>(0, max_run - min_run + 1); };
+    Double_t num_match = 0;
+    for (const auto& datasetA_metadata : datasetA_files){
+        if (!datasetA_metadata.is_valid || (datasetA_metadata.num_entries == 0)) continue;
+        Double_t datasetA_file_num_match = 0;
+        for (const auto& datasetB_metadata : datasetB_files){
+            if (!datasetB_metadata.is_valid || (datasetB_metadata.num_entries == 0)) continue;
+            Long64_t num_common_runs = get_num_runs(std::max(datasetA_metadata.min_run, datasetB_metadata.min_run), std::min(datasetA_metadata.max_run, datasetB_metadata.max_run));
+            if (num_common_runs == 0) continue;
+            datasetA_file_num_match += std::min(Double_t(datasetA_metadata.num_entries) * num_common_runs / get_num_runs(datasetA_metadata.min_run, datasetA_metadata.max_run),
+                                                Double_t(datasetB_metadata.num_entries) * num_common_runs / get_num_runs(datasetB_metadata.min_run, datasetB_metadata.max_run));
+        }
+        num_match += std::min<Double_t>(datasetA_file_num_match, datasetA_metadata.num_entries);
+    }
+    return std::min(num_match, max_num_match);
+}
+
+Double_t get_matching_cost(const dataset_profile& indexed, const dataset_profile& probed, Double_t num_match, bool is_indexed_order, Long64_t block_size){
+    // key passes, building the index and looking up every probed entry
+    Double_t cost = indexed.num_entries * indexed.key_zip_bytes_per_entry + probed.num_entries * probed.key_zip_bytes_per_entry;
+
+    // read in entry order, a cluster is decompressed if any of its entries matches
+    auto get_sequential_cost = [&](const dataset_profile& profile){
+        if (profile.num_entries == 0) return 0.;
+        Double_t match_fraction = std::min(1., num_match / profile.num_entries);
+        Double_t num_clusters = Double_t(profile.num_entries) / profile.cluster_num_entries;
+        return num_clusters * (1 - std::pow(1 - match_fraction, Double_t(profile.cluster_num_entries))) * profile.cluster_num_entries * profile.zip_bytes_per_entry;
+    };
+    cost += get_sequential_cost(probed);
+
+    // the indexed side follows the probe order, each match decompresses a cluster unless both sides are sorted alike,
+    // in indexed-entry order each block decompresses its distinct clusters once, capped at one cluster per match
+    Double_t cluster_zip_bytes = indexed.cluster_num_entries * indexed.zip_bytes_per_entry;
+    Double_t random_cost = num_match * cluster_zip_bytes;
+    if (is_indexed_order){
+        Double_t num_clusters = std::max(1., Double_t(indexed.num_entries) / indexed.cluster_num_entries);
+        Double_t num_block_clusters = num_clusters * (1 - std::pow(1 - 1 / num_clusters, Double_t(block_size)));
+        random_cost = std::min(random_cost, num_match / block_size * num_block_clusters * cluster_zip_bytes);
+    }
+    Double_t co_sortedness = indexed.sortedness * probed.sortedness;
+    cost += co_sortedness * get_sequential_cost(indexed) + (1 - co_sortedness) * std::max(random_cost, get_sequential_cost(indexed));
+    return cost;
+}
+
+matching_plan plan_matching(TChain *datasetA_chain, TChain *datasetB_chain, const std::vector<file_metadata>& datasetA_files, const std::vector<file_metadata>& datasetB_files, bool is_merged){
+    dataset_profile datasetA_profile = get_dataset_profile(datasetA_chain);
+    dataset_profile datasetB_profile = get_dataset_profile(datasetB_chain);
+    matching_plan plan;
+    plan.expected_num_match = get_expected_num_match(datasetA_files, datasetB_files, datasetA_profile.num_entries, datasetB_profile.num_entries);
+    Long64_t block_size = std::max<Long64_t>(1, get_cluster_num_entries(get_tree_bytes_per_entry(datasetA_chain) + get_tree_bytes_per_entry(datasetB_chain))); // as the deduplication blocks
+
+    // only the indexed dataset is chosen, the probe order follows from the mode
+    bool is_indexed_order = is_merged && use_deduplication;
+    auto get_cost = [&](bool is_swapped, bool is_indexed_order){
+        return is_swapped ? get_matching_cost(datasetB_profile, datasetA_profile, plan.expected_num_match, is_indexed_order, block_size)
+                          : get_matching_cost(datasetA_profile, datasetB_profile, plan.expected_num_match, is_indexed_order, block_size);
+    };
+
+    // start from the dataset with fewer entries indexed, switch only if cheaper
+    plan.is_swapped = datasetA_profile.num_entries > datasetB_profile.num_entries;
+    plan.entries_rule_cost = get_cost(plan.is_swapped, is_indexed_order);
+    plan.cost = plan.entries_rule_cost;
+    if (use_cost_based_planner && (get_cost(!plan.is_swapped, is_indexed_order) < plan.cost)){
+        plan.is_swapped = !plan.is_swapped;
+        plan.cost = get_cost(plan.is_swapped, is_indexed_order);
+    }
 
     // print summary
-    std::cout << std::format("{:=^75}", "SUMMARY: Matching Trees") << std::endl;
-    std::cout << std::format("Total time: {:%T}", elapsed_time) << std::endl;
-    std::cout << std::format("Average time per entry: {:.05f} ms", elapsed_time.count() * 1000 / long_chain_num_entries) << std::endl;
-    std::cout << "Number of matched events: " << num_match << std::endl;
+    if (verbose >= 1){
+        std::cout << std::format("{:=^75}", "SUMMARY: Matching Plan") << std::endl;
+        for (const auto& [dataset_name, profile] : {std::pair<const char*, const dataset_profile&>("datasetA", datasetA_profile), std::pair<const char*, const dataset_profile&>("datasetB", datasetB_profile)}){
+            std::cout << std::format("{}: {} entries, {:.01f} bytes per entry compressed, {} entries per cluster, key sortedness {:.02f}",
+                                     dataset_name, profile.num_entries, profile.zip_bytes_per_entry, profile.cluster_num_entries, profile.sortedness) << std::endl;
+        }
+        std::cout << std::format("Sizes and clusters from the first file of each dataset, key sortedness from its first {} and {} entries",
+                                 datasetA_profile.num_sampled_entries, datasetB_profile.num_sampled_entries) << std::endl;
+        std::cout << std::format("Expected matched events: {:.0f}", plan.expected_num_match) << std::endl;
+        std::cout << "Indexed dataset: " << (plan.is_swapped ? "datasetB" : "datasetA") << ", probed dataset: " << (plan.is_swapped ? "datasetA" : "datasetB") << std::endl;
+        std::cout << "Probe order: " << (is_indexed_order ? "indexed entries within blocks (deduplication)" : "probed entries") << std::endl;
+        std::cout << std::format("Estimated cost: {:.03f} GB decompressed ({:.03f} GB indexing the dataset with fewer entries)", plan.cost / 1e9, plan.entries_rule_cost / 1e9) << std::endl;
+        if (!use_cost_based_planner) std::cout << "Planner disabled, the dataset with fewer entries is indexed" << std::endl;
+        std::cout << std::format("{:=^75}", "") << std::endl;
+    }
+    return plan;
+}
+
+Long64_t estimate_matching(TChain *long_chain, TChain *short_chain, const event_index *short_chain_index, const std::vector<file_metadata>& long_chain_files, const std::vector<file_metadata>& short_chain_files, bool is_swapped, bool is_merged, std::chrono::duration<double> index_elapsed_time){
+    std::chrono::steady_clock stopwatch;
+    auto saved_time = stopwatch.now();
+    if (verbose >= 1) std::cout << "Start dry run over " << long_chain->GetEntries() << " entries..." << std::endl;
+
+    // entries and matches per run
+    struct run_count {
+        Long64_t num_long_chain_entries = 0;
+        Long64_t num_short_chain_entries = 0;
+        Long64_t num_match = 0;
+    };
+    std::map<UInt_t, run_count> run_counts;
+
+    // key pass over the short chain, only run is read
+    {
+        TTreeReader short_chain_reader(short_chain);
+        TTreeReaderValue<UInt_t> short_chain_run(short_chain_reader, "run");
+        while (short_chain_reader.Next()) run_counts[*short_chain_run].num_short_chain_entries++;
+    }
+
+    // files pruned for lack of run overlap, only run is read, so runs in one dataset only still show up
+    for (bool is_long_chain : {false, true}){
+        TChain pruned_chain("Events");
+        for (const auto& metadata : is_long_chain ? long_chain_files : short_chain_files){
+            if (metadata.is_pruned) pruned_chain.AddFile(metadata.filename.c_str(), metadata.num_entries);
+        }
+        if (pruned_chain.GetNtrees() == 0) continue;
+        TTreeReader pruned_chain_reader(&pruned_chain);
+        TTreeReaderValue<UInt_t> pruned_chain_run(pruned_chain_reader, "run");
+        while (pruned_chain_reader.Next()){
+            run_count& count = run_counts[*pruned_chain_run];
+            (is_long_chain ? count.num_long_chain_entries : count.num_short_chain_entries)++;
+        }
+    }
+
+    // key pass over the long chain with lookups, only run and event are read, the first matches are kept for the sample
+    Long64_t num_match = 0;
+    std::vector<std::pair<Long64_t, Long64_t>> sampled_matches;
+    {
+        TTreeReader long_chain_reader(long_chain);
+        TTreeReaderValue<UInt_t> long_chain_run(long_chain_reader, "run");
+        TTreeReaderValue<ULong64_t> long_chain_event_number(long_chain_reader, "event");
+        while (long_chain_reader.Next()){
+            run_count& count = run_counts[*long_chain_run];
+            count.num_long_chain_entries++;
+            Long64_t i_short_chain = get_entry_number_with_index(short_chain, short_chain_index, *long_chain_run, *long_chain_event_number);
+            if (i_short_chain == -1) continue;
+            count.num_match++;
+            num_match++;
+            if (Long64_t(sampled_matches.size()) < dry_run_sample_size) sampled_matches.emplace_back(long_chain_reader.GetCurrentEntry(), i_short_chain);
+        }
+    }
+    std::chrono::duration<double> key_pass_elapsed_time = stopwatch.now() - saved_time;
+
+    // full reads of the sample, as in the copy loop
+    saved_time = stopwatch.now();
+    for (const auto& [i_long_chain, i_short_chain] : sampled_matches){
+        long_chain->GetEntry(i_long_chain);
+        short_chain->GetEntry(i_short_chain);
+    }
+    std::chrono::duration<double> sample_elapsed_time = stopwatch.now() - saved_time;
+    Double_t read_time_per_match = sampled_matches.empty() ? 0 : sample_elapsed_time.count() / sampled_matches.size();
+    std::chrono::duration<double> projected_elapsed_time = index_elapsed_time + key_pass_elapsed_time + std::chrono::duration<double>(read_time_per_match * num_match);
+
+    // output size from the input branch sizes, the output file size limit counts bytes before compression
+    Double_t bytes_per_entry = get_tree_bytes_per_entry(long_chain) + get_tree_bytes_per_entry(short_chain);
+    Double_t zip_bytes_per_entry = get_tree_bytes_per_entry(long_chain, true) + get_tree_bytes_per_entry(short_chain, true);
+    Long64_t num_out_files = std::max<Long64_t>(1, Long64_t(std::ceil(num_match * bytes_per_entry / out_tree_max_size)));
+
+    // per-run overlap, datasetA is the short chain unless chains were swapped
+    Long64_t long_chain_unpruned_num_entries = get_unpruned_num_entries(long_chain, long_chain_files);
+    Long64_t short_chain_unpruned_num_entries = get_unpruned_num_entries(short_chain, short_chain_files);
+    Long64_t datasetA_num_entries = is_swapped ? long_chain_unpruned_num_entries : short_chain_unpruned_num_entries;
+    Long64_t datasetB_num_entries = is_swapped ? short_chain_unpruned_num_entries : long_chain_unpruned_num_entries;
+    Int_t num_datasetA_runs = 0, num_datasetB_runs = 0, num_common_runs = 0;
+    for (const auto& [run, count] : run_counts){
+        Long64_t datasetA_run_num_entries = is_swapped ? count.num_long_chain_entries : count.num_short_chain_entries;
+        Long64_t datasetB_run_num_entries = is_swapped ? count.num_short_chain_entries : count.num_long_chain_entries;
+        if (datasetA_run_num_entries > 0) num_datasetA_runs++;
+        if (datasetB_run_num_entries > 0) num_datasetB_runs++;
+        if ((datasetA_run_num_entries > 0) && (datasetB_run_num_entries > 0)) num_common_runs++;
+    }
+    if (verbose >= 1) std::cout << "Finish dry run over " << long_chain->GetEntries() << " entries..." << std::endl;
+
+    // print summary
+    std::cout << std::format("{:=^75}", "SUMMARY: Dry Run") << std::endl;
+    if (verbose >= 2){
+        for (const auto& [run, count] : run_counts){
+            Long64_t datasetA_run_num_entries = is_swapped ? count.num_long_chain_entries : count.num_short_chain_entries;
+            Long64_t datasetB_run_num_entries = is_swapped ? count.num_short_chain_entries : count.num_long_chain_entries;
+            std::cout << std::format("Run {:>8}: {:>10} A, {:>10} B, {:>10} matched ({:7.03f}%/A, {:7.03f}%/B)", run, datasetA_run_num_entries, datasetB_run_num_entries, count.num_match,
+                                     Double_t(count.num_match)/std::max<Long64_t>(datasetA_run_num_entries, 1) * 100, Double_t(count.num_match)/std::max<Long64_t>(datasetB_run_num_entries, 1) * 100) << std::endl;
+        }
+    }
+    std::cout << std::format("Runs: {} in datasetA, {} in datasetB, {} in both", num_datasetA_runs, num_datasetB_runs, num_common_runs) << std::endl;
+    std::cout << "Number of matched events (before filters): " << num_match << std::endl;
     std::cout << TString::Format("Percent matched events from datasetA: %lld/%lld (%.03f%%)", num_match, datasetA_num_entries, Double_t(num_match)/datasetA_num_entries * 100) << std::endl;
     std::cout << TString::Format("Percent matched events from datasetB: %lld/%lld (%.03f%%)", num_match, datasetB_num_entries, Double_t(num_match)/datasetB_num_entries * 100) << std::endl;
+    std::cout << std::format("Estimated output size: {:.03f} GB ({:.01f} bytes per entry compressed as input, {:.01f} before compression)", num_match * zip_bytes_per_entry / 1e9, zip_bytes_per_entry, bytes_per_entry) << std::endl;
+    if (is_merged) std::cout << "Estimated number of output files: " << num_out_files << std::endl;
+    std::cout << std::format("Key pass time: {:%T}", key_pass_elapsed_time) << std::endl;
+    if (!sampled_matches.empty()){
+        std::cout << std::format("Full read time per matched event: {:.05f} ms (first {} matched events read in full, all active branches)", read_time_per_match * 1000, sampled_matches.size()) << std::endl;
+        std::cout << std::format("Projected total time (index, key pass, reads, without output compression): {:%T}", projected_elapsed_time) << std::endl;
+    } else {
+        std::cout << "Full read time per matched event: not sampled, set dry_run_sample_size to project the copy time" << std::endl;
+    }
+    if (num_common_runs == 0) std::cout << "No run in common, check the file lists" << std::endl;
+    std::cout << std::format("{:=^75}", "") << std::endl;
+    return num_match;
+}
+
+void match_trees_batch() {
+    // stop watch
+    std::chrono::steady_clock stopwatch;
+    auto saved_time = stopwatch.now();
+
+    // reference chain, not pruned so every job rebuilds it with the same entry numbers
+    if (verbose >= 2) std::cout << "Start building reference chain..." << std::endl;
+    std::vector<file_metadata> reference_files = scan_filelist(reference_filelist_filename);
+    int reference_num_files = 0;
+    TChain *reference_chain = build_chain(reference_files, reference_num_files);
+    if (verbose >= 2) std::cout << "Finish building reference chain with " << reference_num_files << " files..." << std::endl;
+
+    // build lookup index once
+    if (verbose >= 1) std::cout << "Start building lookup index..." << std::endl;
+    saved_time = stopwatch.now();
+    event_index reference_index;
+    reference_index.build(reference_chain);
+    std::chrono::duration<double> elapsed_time = stopwatch.now() - saved_time;
+    delete reference_chain;
+    if (verbose >= 1) std::cout << "Finish building lookup index with " << reference_index.size() << " entries..." << std::endl;
+    // print summary
+    std::cout << std::format("{:=^75}", "SUMMARY: Building Lookup indices") << std::endl;
+    std::cout << std::format("Total time: {:%T}", elapsed_time) << std::endl;
+    std::cout << std::format("Average time per entry: {:.05f} ms", elapsed_time.count() * 1000 / std::max<Long64_t>(reference_index.size(), 1)) << std::endl;
+    std::cout << std::format("Index size: {:.03f} MB ({:.02f} bytes per entry)", reference_index.get_num_bytes() / 1e6, Double_t(reference_index.get_num_bytes()) / std::max<Long64_t>(reference_index.size(), 1)) << std::endl;
+    std::cout << std::format("{:=^75}", "") << std::endl;
+
+    // scan probe file lists once before the jobs, so concurrent jobs do not each start a pool of startup_num_threads
+    if (verbose >= 2) std::cout << "Start scanning probe file lists..." << std::endl;
+    std::vector<std::vector<file_metadata>> probe_files(probe_jobs.size());
+    for (size_t i_job = 0; i_job < probe_jobs.size(); ++i_job){
+        probe_files[i_job] = scan_filelist(probe_jobs[i_job].filelist_filename);
+        if (prune_files_without_run_overlap) prune_files_by_run_range(probe_files[i_job], reference_files);
+    }
+    if (verbose >= 2) std::cout << "Finish scanning probe file lists..." << std::endl;
+
+    // run probe jobs, on a bounded pool if concurrent, each worker takes the next job not yet taken
+    // dry runs go one after another so their summaries are not interleaved
+    saved_time = stopwatch.now();
+    std::vector<probe_result> results(probe_jobs.size());
+    int num_concurrent_jobs = dry_run ? 1 : probe_num_concurrent_jobs;
+    if (num_concurrent_jobs > 1) ROOT::EnableThreadSafety();
+    std::atomic<size_t> next_job_index(0);
+    auto job_worker = [&](){
+        for (size_t i_job = next_job_index++; i_job < probe_jobs.size(); i_job = next_job_index++)
+            results[i_job] = run_probe_job(probe_jobs[i_job], i_job, reference_index, reference_files, probe_files[i_job]);
+    };
+    if (num_concurrent_jobs > 1){
+        std::vector<std::thread> workers;
+        for (size_t i_worker = 0; i_worker < std::min<size_t>(num_concurrent_jobs, probe_jobs.size()); ++i_worker)
+            workers.emplace_back(job_worker);
+        for (auto& worker : workers) worker.join();
+    } else {
+        job_worker();
+    }
+    elapsed_time = stopwatch.now() - saved_time;
+
+    // print summary
+    std::cout << std::format("{:=^75}", "SUMMARY: Matching Trees (batch)") << std::endl;
+    if (dry_run) std::cout << "Dry run, nothing was written, matches are before filters" << std::endl;
+    std::cout << std::format("Total time: {:%T}", elapsed_time) << std::endl;
+    for (size_t i_job = 0; i_job < probe_jobs.size(); ++i_job){
+        const probe_result& result = results[i_job];
+        std::cout << std::format("{}: {} matched, {} rejected by filters, {}/{} probe entries ({:.03f}%), {:%T}", probe_jobs[i_job].out_directory, result.num_match, result.num_filtered,
+                                 result.num_match, result.num_entries, Double_t(result.num_match)/std::max<Long64_t>(result.num_entries, 1) * 100, result.elapsed_time) << std::endl;
+    }
     std::cout << std::format("{:=^75}", "") << std::endl;
 }
 
+probe_result run_probe_job(const probe_job& job, int job_index, const event_index& reference_index, const std::vector<file_metadata>& reference_files, const std::vector<file_metadata>& probe_files){
+    if (verbose >= 1) std::cout << "Start probe job " << job.out_directory << "..." << std::endl;
+
+    // chains of this job, the reference chain has the same entry numbers as the index
+    int reference_num_files = 0;
+    int probe_num_files = 0;
+    TChain *reference_chain = build_chain(reference_files, reference_num_files);
+    TChain *probe_chain = build_chain(probe_files, probe_num_files);
+
+    // set active branches
+    if (!job.branch_patterns.empty()){
+        reference_chain->SetBranchStatus("*", false);
+        probe_chain->SetBranchStatus("*", false);
+        for (const std::string& branch_pattern : job.branch_patterns){
+            reference_chain->SetBranchStatus(branch_pattern.c_str(), true);
+            probe_chain->SetBranchStatus(branch_pattern.c_str(), true);
+        }
+    }
+    reference_chain->SetBranchStatus("run", true);
+    reference_chain->SetBranchStatus("event", true);
+    probe_chain->SetBranchStatus("run", true);
+    probe_chain->SetBranchStatus("event", true);
+
+    // estimate from the keys and a sample of full reads, nothing is written, the index time is in the batch summary
+    if (dry_run){
+        probe_result result;
+        std::chrono::steady_clock stopwatch;
+        auto saved_time = stopwatch.now();
+        result.num_entries = get_unpruned_num_entries(probe_chain, probe_files);
+        result.num_match = estimate_matching(probe_chain, reference_chain, &reference_index, probe_files, reference_files, false, false, std::chrono::duration<double>(0));
+        result.elapsed_time = stopwatch.now() - saved_time;
+        delete probe_chain;
+        delete reference_chain;
+        if (verbose >= 1) std::cout << "Finish probe job " << job.out_directory << " dry run with " << result.num_match << " matched events..." << std::endl;
+        return result;
+    }
+
+    // set up output directory
+    std::string job_out_directory = (job.out_directory[job.out_directory.length()-1] != '/') ? job.out_directory : job.out_directory.substr(0, job.out_directory.length()-1); // remove tailing slash if any
+    std::filesystem::create_directories(job_out_directory.c_str()); // create output directory if not exist
+
+    // same probe loop as match_trees_no_merged, the reference is datasetA (short chain) and the probe is datasetB (long chain)
+    probe_result result = copy_matched_events(probe_chain, reference_chain, &reference_index, job.branchname_prefix, reference_branchname_prefix, false,
+                                              probe_files, reference_files, job_out_directory, std::format("_{}", job_index), probe_num_concurrent_jobs <= 1);
+    delete probe_chain;
+    delete reference_chain;
+
+    if (verbose >= 1) std::cout << "Finish probe job " << job.out_directory << " with " << result.num_match << " matched events..." << std::endl;
+    return result;
+}
+
 void match_trees_merged() { 
     if (verbose >= 2) std::cout << "Start setting up..." << std::endl;
     // stop watch
@@ -275,26 +1032,19 @@ void match_trees_merged() {
     if (verbose >= 2) std::cout << "Start building input chains..." << std::endl;
     int short_chain_num_files = 0;
     int long_chain_num_files = 0;
-    TChain *short_chain = build_chain(datasetA_filelist_filename, short_chain_num_files);
-    TChain *long_chain = build_chain(datasetB_filelist_filename, long_chain_num_files);
+    TChain *short_chain = nullptr;
+    TChain *long_chain = nullptr;
+    std::unordered_map<std::string, Int_t> short_chain_counter_maxima, long_chain_counter_maxima;
+    std::vector<file_metadata> datasetA_files, datasetB_files;
+    build_input_chains(datasetA_filelist_filename, datasetB_filelist_filename, short_chain, long_chain, short_chain_num_files, long_chain_num_files, short_chain_counter_maxima, long_chain_counter_maxima, &datasetA_files, &datasetB_files);
     std::string short_chain_branchname_prefix = datasetA_branchname_prefix;
     std::string long_chain_branchname_prefix = datasetB_branchname_prefix;
     Long64_t short_chain_num_entries = short_chain->GetEntries();
     Long64_t long_chain_num_entries = long_chain->GetEntries();
-    Long64_t datasetA_num_entries = short_chain_num_entries;
-    Long64_t datasetB_num_entries = long_chain_num_entries;
+    Long64_t datasetA_num_entries = get_unpruned_num_entries(short_chain, datasetA_files);
+    Long64_t datasetB_num_entries = get_unpruned_num_entries(long_chain, datasetB_files);
     if (verbose >= 2) std::cout << "Finish building input chains..." << std::endl;
 
-    // swap chain if first chain is longer than the second chain
-    if (short_chain_num_entries > long_chain_num_entries) {
-        if (verbose >= 3) std::cout << "Swapping input chains" << std::endl;
-        std::swap(short_chain, long_chain);
-        std::swap(short_chain_branchname_prefix, long_chain_branchname_prefix);
-        std::swap(short_chain_num_files, long_chain_num_files);
-        std::swap(short_chain_num_entries, long_chain_num_entries);
-        std::swap(datasetA_num_entries, datasetB_num_entries);
-    }
-
     // set active branches
     short_chain->SetBranchStatus("*", false);
     long_chain->SetBranchStatus("*", false);
@@ -319,12 +1069,29 @@ void match_trees_merged() {
     short_chain->SetBranchStatus("event", true); 
     long_chain->SetBranchStatus("run", true); 
     long_chain->SetBranchStatus("event", true); 
+
+    // choose the indexed (short) chain, on the active branches; swap chain if datasetA is to be probed
+    matching_plan plan = plan_matching(short_chain, long_chain, datasetA_files, datasetB_files, true);
+    bool is_swapped = false;
+    if (plan.is_swapped) {
+        if (verbose >= 3) std::cout << "Swapping input chains" << std::endl;
+        is_swapped = true;
+        std::swap(short_chain, long_chain);
+        std::swap(short_chain_branchname_prefix, long_chain_branchname_prefix);
+        std::swap(short_chain_num_files, long_chain_num_files);
+        std::swap(short_chain_counter_maxima, long_chain_counter_maxima);
+        std::swap(short_chain_num_entries, long_chain_num_entries);
+        std::swap(datasetA_num_entries, datasetB_num_entries);
+    }
     if (verbose >= 2) std::cout << "Finish setting up..." << std::endl;
 
     // build lookup indices for short chain
     if (verbose >= 1) std::cout << "Start building lookup indices with " << short_chain->GetEntries() << " entries..." << std::endl;
     saved_time = stopwatch.now();
-    short_chain->BuildIndex("run", "event");
+    event_index short_chain_compact_index;
+    if (use_compact_index) short_chain_compact_index.build(short_chain);
+    else short_chain->BuildIndex("run", "event");
+    const event_index *short_chain_index = use_compact_index ? &short_chain_compact_index : nullptr; // nullptr for the TChainIndex
     current_time = stopwatch.now();
     elapsed_time = current_time - saved_time;
     if (verbose >= 1) std::cout << "Finish building lookup indices with " << short_chain_num_entries << " entries..." << std::endl;
@@ -332,8 +1099,15 @@ void match_trees_merged() {
     std::cout << std::format("{:=^75}", "SUMMARY: Building Lookup indices") << std::endl;
     std::cout << std::format("Total time: {:%T}", elapsed_time) << std::endl;
     std::cout << std::format("Average time per entry: {:.05f} ms", elapsed_time.count() * 1000 / short_chain_num_entries) << std::endl;
+    if (short_chain_index) std::cout << std::format("Index size: {:.03f} MB ({:.02f} bytes per entry)", short_chain_index->get_num_bytes() / 1e6, Double_t(short_chain_index->get_num_bytes()) / std::max<Long64_t>(short_chain_index->size(), 1)) << std::endl;
     std::cout << std::format("{:=^75}", "") << std::endl;
 
+    // estimate from the keys and a sample of full reads, nothing is written
+    if (dry_run){
+        estimate_matching(long_chain, short_chain, short_chain_index, is_swapped ? datasetA_files : datasetB_files, is_swapped ? datasetB_files : datasetA_files, is_swapped, true, elapsed_time);
+        return;
+    }
+
     // set up output directory
     if (verbose >= 3) std::cout << "Start preparing output directory..." << std::endl;
     out_directory = (out_directory[out_directory.length()-1] != '/') ? out_directory : out_directory.substr(0, out_directory.length()-1); // remove tailing slash if any
@@ -355,12 +1129,34 @@ void match_trees_merged() {
     //TTreeReaderValue<UInt_t> *short_chain_run = new TTreeReaderValue<UInt_t>(short_chain_reader, "run");
     //TTreeReaderValue<ULong64_t> *short_chain_event_number = new TTreeReaderValue<ULong64_t>(short_chain_reader, "event");
 
+    // stage input files to local scratch in the background
+    std::unique_ptr<file_stager> long_chain_stager, short_chain_stager;
+    if (use_staging){
+        long_chain_stager = std::make_unique<file_stager>(long_chain, "long", true, is_swapped ? datasetA_files : datasetB_files);
+        short_chain_stager = std::make_unique<file_stager>(short_chain, "short", false, is_swapped ? datasetB_files : datasetA_files);
+    }
+
+    // build event filters on the readers, these only read their predicate branches
+    event_filter long_chain_filter, short_chain_filter, joined_chain_filter;
+    build_event_filters(long_chain_reader, short_chain_reader, is_swapped, long_chain_filter, short_chain_filter, joined_chain_filter);
+
     // build out_tree_base holding branches
     if (verbose >= 2) std::cout << "Start building output tree..." << std::endl;
     TTree *out_tree_base = new TTree("Events", "Events");
     std::unordered_map<std::string, void*> data_addresses;
-    append_branches_from_tree(long_chain, out_tree_base, data_addresses, long_chain_branchname_prefix);
-    append_branches_from_tree(short_chain, out_tree_base, data_addresses, short_chain_branchname_prefix);
+    append_branches_from_tree(long_chain, out_tree_base, data_addresses, long_chain_branchname_prefix, &long_chain_counter_maxima);
+    append_branches_from_tree(short_chain, out_tree_base, data_addresses, short_chain_branchname_prefix, &short_chain_counter_maxima);
+
+    // object-level matching outputs
+    std::vector<collection_match_state> collection_match_states = append_collection_match_branches(out_tree_base, data_addresses);
+
+    // tune compression, basket size and auto-flush from input bytes per entry, clones inherit these settings
+    Long64_t out_tree_cluster_num_entries = get_cluster_num_entries(get_tree_bytes_per_entry(long_chain) + get_tree_bytes_per_entry(short_chain));
+    configure_output_branches(long_chain, out_tree_base, long_chain_branchname_prefix, out_tree_cluster_num_entries);
+    configure_output_branches(short_chain, out_tree_base, short_chain_branchname_prefix, out_tree_cluster_num_entries);
+    out_tree_base->SetAutoFlush(out_tree_cluster_num_entries);
+    if (verbose >= 2) std::cout << "Output cluster size: " << out_tree_cluster_num_entries << " entries" << std::endl;
+    if ((verbose >= 2) && use_deduplication) std::cout << "Deduplication enabled, blocks of about one output cluster" << std::endl;
     if (verbose >= 2) std::cout << "Finish building output tree..." << std::endl;
 
     // synchronize trees
@@ -370,16 +1166,82 @@ void match_trees_merged() {
     // Int_t out_tree_saved_short_chain_current_tree_number = short_chain_current_tree_number;
     // std::cout << "save tree number..." << std::endl;
     
-    // clone for running out tree
-    auto out_tree = out_tree_base->CloneTree(0);
-    // std::cout << "clone..." << std::endl;
-
     // loop parameter
     Long64_t num_match = 0;
+    Long64_t num_filtered = 0;
     Long64_t out_tree_current_num_entries = 0;
     Long64_t out_tree_current_size = 0;
+
+    // find branches identical in both datasets on a sample of matched events
+    std::vector<shared_column> shared_columns;
+    if (use_deduplication){
+        if (verbose >= 2) std::cout << "Start sampling matched events for deduplication..." << std::endl;
+        shared_columns = find_shared_columns(long_chain, short_chain, long_chain_branchname_prefix, short_chain_branchname_prefix, is_swapped, short_chain_index, data_addresses, out_tree_base, long_chain_saved_tree_number, short_chain_saved_tree_number);
+        if (verbose >= 2) std::cout << "Finish sampling matched events for deduplication, " << shared_columns.size() << " shared branches..." << std::endl;
+    }
+    Int_t num_shared_columns = shared_columns.size();
+
+    // clone for running out tree
+    auto out_tree = clone_out_tree(out_tree_base, shared_columns);
+    TFile *out_file = nullptr; // opened with the first entry of each output file
+
+    // write the current output file and start the next one
+    auto write_out_file = [&](){
+        if (verbose >= 2) std::cout << "Saving to file " << out_file->GetName() << std::endl;
+        out_file->cd();
+        out_tree->Write();
+        out_file->Close(); // out_tree is owned and deleted by out_file
+        delete out_file;
+        out_file = nullptr;
+
+        // reset out_tree
+        out_tree = clone_out_tree(out_tree_base, shared_columns);
+        out_tree_current_num_entries = 0;
+        out_tree_current_size = 0;
+
+        // increment file index
+        out_file_index++;
+    };
+    // std::cout << "clone..." << std::endl;
+
     bool is_last_entry = !long_chain_reader.Next();
 
+    // deduplication blocks of about one output cluster, checked before they are written, clusters are closed by TTree::Fill auto-flush.
+    // Block size comes from get_cluster_num_entries, from the input bytes per entry, then from the bytes of the last block
+    Long64_t block_size = std::max<Long64_t>(1, get_cluster_num_entries(get_tree_bytes_per_entry(long_chain) + get_tree_bytes_per_entry(short_chain)));
+    std::vector<Long64_t> block_long_chain_entries, block_short_chain_entries;
+    Int_t block_long_chain_tree_number = -1; // lowest tree of the block, the sequential stager keeps files from here on
+    std::unordered_map<std::string, block_column> block_columns;
+    auto copy_block = [&](){
+        Long64_t num_rows = block_long_chain_entries.size();
+        block_columns.clear(); // rebuilt from the trees of this block, no sizes left over from branches of earlier files
+        read_block_columns(long_chain, block_long_chain_entries, long_chain_branchname_prefix, block_columns, long_chain_saved_tree_number, out_tree_base, out_tree, data_addresses, nullptr);
+        read_block_columns(short_chain, block_short_chain_entries, short_chain_branchname_prefix, block_columns, short_chain_saved_tree_number, out_tree_base, out_tree, data_addresses, short_chain_stager.get());
+        if (check_shared_columns_in_block(shared_columns, block_columns, num_rows) > 0){ // diverged, write these branches twice from here on
+            if (out_tree_current_num_entries > 0){
+                add_diverged_branches(out_tree, out_tree_base, shared_columns, data_addresses);
+            } else {
+                delete out_tree;
+                out_tree = clone_out_tree(out_tree_base, shared_columns);
+            }
+        }
+        if (out_tree_current_num_entries == 0){
+            TString out_file_path = TString::Format("%s/%s_%d.root", out_directory.c_str(), out_filename_prefix.c_str(), out_file_index);
+            out_file = TFile::Open(out_file_path.Data(), "RECREATE", "", ROOT::CompressionSettings(out_compression_algorithm, out_compression_level));
+            out_tree->SetDirectory(out_file);
+            out_tree_current_size += get_tree_byte_size(out_tree);
+        }
+        out_tree_current_size += write_block_columns(out_tree, block_columns, data_addresses, collection_match_states, out_tree_base, num_rows);
+        out_tree_current_num_entries += num_rows;
+        block_long_chain_entries.clear();
+        block_short_chain_entries.clear();
+        block_long_chain_tree_number = -1;
+
+        Double_t block_bytes = 0;
+        for (const auto& [dst_branch_name, column] : block_columns) block_bytes += column.data.size();
+        if (block_bytes > 0) block_size = std::max<Long64_t>(1, get_cluster_num_entries(block_bytes / num_rows));
+    };
+
     Long64_t print_every_entries = Long64_t(print_every_percent * long_chain_num_entries / 100);
     int short_chain_num_entries_num_digits = std::to_string(short_chain_num_entries).length();
     int long_chain_num_entries_num_digits = std::to_string(long_chain_num_entries).length();
@@ -393,14 +1255,28 @@ void match_trees_merged() {
         // std::cout << long_chain->GetTree()->GetBranch("run")->GetAddress() << std::endl;
         
         Long64_t i_long_chain = long_chain_reader.GetCurrentEntry();
+        if (long_chain_stager) long_chain_stager->update((block_long_chain_tree_number != -1) ? block_long_chain_tree_number : long_chain->GetTreeNumber());
         // search for corresponding event
-        Long64_t i_short_chain = short_chain->GetEntryNumberWithIndex(*long_chain_run, *long_chain_event_number);
+        Long64_t i_short_chain = get_entry_number_with_index(short_chain, short_chain_index, *long_chain_run, *long_chain_event_number);
+
+        // evaluate filters before reading the full entries
+        if (i_short_chain != -1){
+            short_chain_reader.SetEntry(i_short_chain);
+            if (short_chain_stager) short_chain_stager->update(short_chain->GetTreeNumber());
+            if (!pass_event_filters(long_chain_filter, short_chain_filter, joined_chain_filter)){
+                num_filtered++;
+                i_short_chain = -1;
+            }
+        }
         
-        if (i_short_chain != -1){ // found match
+        if ((i_short_chain != -1) && use_deduplication){ // found match, copy later with its block
+            num_match++;
+            if (block_long_chain_entries.empty()) block_long_chain_tree_number = long_chain->GetTreeNumber();
+            block_long_chain_entries.push_back(i_long_chain);
+            block_short_chain_entries.push_back(i_short_chain);
+        } else if (i_short_chain != -1){ // found match
             num_match++; 
             out_tree_current_num_entries++;
-
-            short_chain_reader.SetEntry(i_short_chain);
             //std::cout << std::format("{} {} {} {}", *long_chain_run, **short_chain_run, *long_chain_event_number, **short_chain_event_number)<< std::endl;
 
             // we might need to re-allocate memory
@@ -424,12 +1300,23 @@ void match_trees_merged() {
             long_chain->GetEntry(i_long_chain); 
             short_chain->GetEntry(i_short_chain);
             
+            // object-level matching on the freshly read collections
+            for (auto& state : collection_match_states)
+                match_collections(state, data_addresses, out_tree_base, out_tree);
+
             // copy_addresses(short_chain, out_tree, short_chain_branchname_prefix);
             // copy_addresses(long_chain, out_tree, long_chain_branchname_prefix);
             
             // sync_addresses(short_chain, out_tree, short_chain_branchname_prefix);
             // sync_addresses(long_chain, out_tree, long_chain_branchname_prefix);
 
+            // attach to a new output file before the first fill, so baskets are flushed there while filling
+            if (out_tree_current_num_entries == 1){
+                TString out_file_path = TString::Format("%s/%s_%d.root", out_directory.c_str(), out_filename_prefix.c_str(), out_file_index);
+                out_file = TFile::Open(out_file_path.Data(), "RECREATE", "", ROOT::CompressionSettings(out_compression_algorithm, out_compression_level));
+                out_tree->SetDirectory(out_file);
+            }
+
             // save to output tree
             Int_t num_byte_write = out_tree->Fill();
             if (out_tree_current_num_entries == 1){ // first entry
@@ -453,28 +1340,17 @@ void match_trees_merged() {
             std::cout << std::endl;
             //std::cout << std::format("Processing entry {} of {} entries ({:03.02f}%) Elapsed Time: {:%T} Average time per entry: {:06.02f}% Projected Remaining Time: {:%T}", i_long_chain+1, long_chain_num_entries, double(i_long_chain+1)/long_chain_num_entries * 100, elapsed_time, elapsed_time.count(), elapsed_time/(i_long_chain+1) * long_chain_num_entries - elapsed_time) << std::endl;
         }
+        // copy a full block before the reader moves on, since reading the block loads other trees of the chains
+        if (Long64_t(block_long_chain_entries.size()) >= block_size) copy_block();
+
         //long_chain_reader.Next();
         is_last_entry = !long_chain_reader.Next();
+        if (is_last_entry && !block_long_chain_entries.empty()) copy_block();
         //std::cout << std::format("{} {} {}", out_tree_current_size, get_tree_byte_size(out_tree), get_tree_byte_size(out_tree) - out_tree_current_size) << std::endl;
         
         // current tree is larger than max size, save to file, and reset tree
         if ((out_tree_current_num_entries > 0) && (is_last_entry || (out_tree_current_size > out_tree_max_size))){
-            // write to file
-            TString out_file_path = TString::Format("%s/%s_%d.root", out_directory.c_str(), out_filename_prefix.c_str(), out_file_index);
-            if (verbose >= 2) std::cout << "Saving to file " << out_file_path << std::endl;
-            TFile *out_file = TFile::Open(out_file_path.Data(), "RECREATE");
-            out_file->cd();
-            out_tree->Write();
-            out_file->Close();
-            
-            // reset out_tree
-            delete out_tree;
-            out_tree = out_tree_base->CloneTree(0);
-            out_tree_current_num_entries = 0;
-            out_tree_current_size = 0;
-    
-            // increment file index
-            out_file_index++;
+            write_out_file();
         }
     }
     current_time = stopwatch.now();
@@ -485,9 +1361,20 @@ void match_trees_merged() {
     std::cout << std::format("{:=^75}", "SUMMARY: Merging Trees") << std::endl;
     std::cout << std::format("Total time: {:%T}", elapsed_time) << std::endl;
     std::cout << std::format("Average time per entry: {:.05f} ms", elapsed_time.count() * 1000 / long_chain_num_entries) << std::endl;
-    std::cout << "Number of matched events: " << num_match << std::endl;
-    std::cout << TString::Format("Percent matched events from datasetA: %lld/%lld (%.03f%%)", num_match, datasetA_num_entries, Double_t(num_match)/datasetA_num_entries * 100) << std::endl;
-    std::cout << TString::Format("Percent matched events from datasetB: %lld/%lld (%.03f%%)", num_match, datasetB_num_entries, Double_t(num_match)/datasetB_num_entries * 100) << std::endl;
+    // matched events before filters, as without filters, then the ones passing filters
+    Long64_t num_raw_match = num_match + num_filtered;
+    std::cout << "Number of matched events: " << num_raw_match << std::endl;
+    std::cout << TString::Format("Percent matched events from datasetA: %lld/%lld (%.03f%%)", num_raw_match, datasetA_num_entries, Double_t(num_raw_match)/datasetA_num_entries * 100) << std::endl;
+    std::cout << TString::Format("Percent matched events from datasetB: %lld/%lld (%.03f%%)", num_raw_match, datasetB_num_entries, Double_t(num_raw_match)/datasetB_num_entries * 100) << std::endl;
+    if (datasetA_filter || datasetB_filter || joined_filter){
+        std::cout << "Number of matched events passing filters: " << num_match << " (" << num_filtered << " rejected)" << std::endl;
+        std::cout << TString::Format("Percent matched events passing filters from datasetA: %lld/%lld (%.03f%%)", num_match, datasetA_num_entries, Double_t(num_match)/datasetA_num_entries * 100) << std::endl;
+        std::cout << TString::Format("Percent matched events passing filters from datasetB: %lld/%lld (%.03f%%)", num_match, datasetB_num_entries, Double_t(num_match)/datasetB_num_entries * 100) << std::endl;
+    }
+    if (use_deduplication){
+        Int_t num_diverged_columns = std::count_if(shared_columns.begin(), shared_columns.end(), [](const shared_column& column){ return !column.is_shared; });
+        std::cout << std::format("Number of deduplicated branches: {} (sampled {}, diverged {})", num_shared_columns - num_diverged_columns, num_shared_columns, num_diverged_columns) << std::endl;
+    }
     std::cout << std::format("{:=^75}", "") << std::endl;
 
     // delete out_tree;
@@ -498,66 +1385,198 @@ void match_trees_merged() {
 
 // helper function implementation
 
-TChain* build_chain(std::string filelist_filename, int &num_files){
+std::vector<file_metadata> scan_filelist(const std::string& filelist_filename){
+    std::vector<file_metadata> files;
     std::ifstream filelist_file(filelist_filename);
     std::string filename;
-    TChain* chain = new TChain("Events");
     while (std::getline(filelist_file, filename)){
-        chain -> AddFile(filename.c_str());
+        if (filename.empty()) continue;
+        file_metadata metadata;
+        metadata.filename = filename;
+        files.push_back(metadata);
+    }
+    if (startup_num_threads <= 0) return files;
+
+    // open files concurrently on a bounded pool, each worker takes the next file not yet taken
+    ROOT::EnableThreadSafety();
+    std::atomic<size_t> next_file_index(0);
+    auto scan_worker = [&](){
+        for (size_t i_file = next_file_index++; i_file < files.size(); i_file = next_file_index++)
+            read_file_metadata(files[i_file]);
+    };
+    std::vector<std::thread> workers;
+    for (size_t i_worker = 0; i_worker < std::min<size_t>(startup_num_threads, files.size()); ++i_worker)
+        workers.emplace_back(scan_worker);
+    for (auto& worker : workers) worker.join();
+    return files;
+}
+
+void read_file_metadata(file_metadata& metadata){
+    metadata.is_scanned = true;
+    std::unique_ptr<TFile> file(TFile::Open(metadata.filename.c_str(), "READ"));
+    if (!file || file->IsZombie()){
+        metadata.is_valid = false;
+        return;
+    }
+    TTree *tree = file->Get<TTree>("Events");
+    if (!tree){
+        metadata.is_valid = false;
+        return;
+    }
+    metadata.num_entries = tree->GetEntries();
+    metadata.file_size = file->GetSize();
+
+    // branch list and counter maxima, counters are found as leaf counts of array branches
+    TObjArray* branches = tree->GetListOfBranches();
+    Int_t num_branches = branches->GetEntriesFast();
+    for (Int_t i_branch = 0; i_branch < num_branches; ++i_branch) {
+        TBranch* branch = (TBranch*)(branches->At(i_branch));
+        metadata.branch_names.push_back(branch->GetName());
+        TLeaf* leaf = (TLeaf*) branch->GetListOfLeaves()->At(0);
+        if (leaf->GetLeafCount()){
+            Int_t& maximum = metadata.counter_maxima[leaf->GetLeafCount()->GetName()];
+            maximum = std::max(maximum, leaf->GetLeafCount()->GetMaximum());
+        }
+    }
+
+    // run range in one pass, only run is read
+    if (metadata.num_entries > 0){
+        TTreeReader reader(tree);
+        TTreeReaderValue<UInt_t> run(reader, "run");
+        metadata.min_run = std::numeric_limits<UInt_t>::max();
+        metadata.max_run = 0;
+        while (reader.Next()){
+            metadata.min_run = std::min(metadata.min_run, *run);
+            metadata.max_run = std::max(metadata.max_run, *run);
+        }
+        if (metadata.min_run > metadata.max_run) metadata.is_valid = false; // run could not be read
+    }
+}
+
+void prune_files_by_run_range(std::vector<file_metadata>& files, const std::vector<file_metadata>& other_files){
+    // merge run ranges of the other dataset, then keep files overlapping any of them
+    std::vector<std::pair<UInt_t, UInt_t>> other_run_ranges;
+    for (const auto& metadata : other_files){
+        if (!metadata.is_scanned) return; // unknown run range, keep everything
+        if (metadata.is_valid && !metadata.is_pruned && (metadata.num_entries > 0)) other_run_ranges.emplace_back(metadata.min_run, metadata.max_run);
+    }
+    std::sort(other_run_ranges.begin(), other_run_ranges.end());
+    std::vector<std::pair<UInt_t, UInt_t>> merged_run_ranges;
+    for (const auto& run_range : other_run_ranges){
+        if (!merged_run_ranges.empty() && (run_range.first <= merged_run_ranges.back().second))
+            merged_run_ranges.back().second = std::max(merged_run_ranges.back().second, run_range.second);
+        else
+            merged_run_ranges.push_back(run_range);
+    }
+
+    for (auto& metadata : files){
+        if (!metadata.is_scanned || !metadata.is_valid || metadata.is_pruned || (metadata.num_entries == 0)) continue;
+        // first merged range ending at or after min_run
+        auto it = std::lower_bound(merged_run_ranges.begin(), merged_run_ranges.end(), metadata.min_run,
+                                   [](const std::pair<UInt_t, UInt_t>& run_range, UInt_t run){ return run_range.second < run; });
+        if ((it == merged_run_ranges.end()) || (it->first > metadata.max_run)) metadata.is_pruned = true; // nothing to match
+    }
+}
+
+std::unordered_map<std::string, Int_t> get_counter_maxima(const std::vector<file_metadata>& files){
+    std::unordered_map<std::string, Int_t> counter_maxima;
+    for (const auto& metadata : files){
+        for (const auto& [counter_name, maximum] : metadata.counter_maxima){
+            Int_t& global_maximum = counter_maxima[counter_name];
+            global_maximum = std::max(global_maximum, maximum);
+        }
+    }
+    return counter_maxima;
+}
+
+void build_input_chains(const std::string& datasetA_filelist_filename, const std::string& datasetB_filelist_filename, TChain*& datasetA_chain, TChain*& datasetB_chain, int& datasetA_num_files, int& datasetB_num_files, std::unordered_map<std::string, Int_t>& datasetA_counter_maxima, std::unordered_map<std::string, Int_t>& datasetB_counter_maxima, std::vector<file_metadata>* datasetA_files_out, std::vector<file_metadata>* datasetB_files_out){
+    std::chrono::steady_clock stopwatch;
+    auto saved_time = stopwatch.now();
+
+    // scan metadata, then prune and build chains with known entries
+    std::vector<file_metadata> datasetA_files = scan_filelist(datasetA_filelist_filename);
+    std::vector<file_metadata> datasetB_files = scan_filelist(datasetB_filelist_filename);
+    if (prune_files_without_run_overlap){
+        prune_files_by_run_range(datasetA_files, datasetB_files);
+        prune_files_by_run_range(datasetB_files, datasetA_files);
+    }
+    datasetA_chain = build_chain(datasetA_files, datasetA_num_files);
+    datasetB_chain = build_chain(datasetB_files, datasetB_num_files);
+    datasetA_counter_maxima = get_counter_maxima(datasetA_files);
+    datasetB_counter_maxima = get_counter_maxima(datasetB_files);
+
+    std::chrono::duration<double> elapsed_time = stopwatch.now() - saved_time;
+    if (verbose >= 2){
+        for (const auto* files : {&datasetA_files, &datasetB_files}){
+            int num_invalid = 0, num_empty = 0, num_pruned = 0, num_different_branches = 0;
+            for (const auto& metadata : *files){
+                if (!metadata.is_valid) num_invalid++;
+                else if (metadata.num_entries == 0) num_empty++;
+                else if (metadata.is_pruned) num_pruned++;
+                else if (metadata.is_scanned && (metadata.branch_names != files->front().branch_names)) num_different_branches++;
+            }
+            std::cout << std::format("Scanned {} files: {} invalid, {} empty, {} pruned, {} with different branches", files->size(), num_invalid, num_empty, num_pruned, num_different_branches) << std::endl;
+        }
+        std::cout << std::format("Building input chains time: {:%T}", elapsed_time) << std::endl;
+    }
+    if (datasetA_files_out) *datasetA_files_out = std::move(datasetA_files);
+    if (datasetB_files_out) *datasetB_files_out = std::move(datasetB_files);
+}
+
+TChain* build_chain(const std::vector<file_metadata>& files, int &num_files){
+    TChain* chain = new TChain("Events");
+    for (const auto& metadata : files){
+        if (!metadata.is_valid || metadata.is_pruned || (metadata.num_entries == 0)) continue;
+        chain -> AddFile(metadata.filename.c_str(), metadata.num_entries); // known entries, TChain does not open the file
         num_files++;
     }
     return chain;
 }
 
+Long64_t get_unpruned_num_entries(TChain *chain, const std::vector<file_metadata>& files){
+    // entries as before pruning, so percentages do not depend on prune_files_without_run_overlap
+    Long64_t num_entries = chain->GetEntries();
+    for (const auto& metadata : files){
+        if (metadata.is_pruned) num_entries += metadata.num_entries;
+    }
+    return num_entries;
+}
+
 // allocate memory
 void* allocate_memory_from_leaf(const char* leaf_type_name, bool singleton, Int_t length){
     void* addr;
+    // singleton is allocated as an array of one, so it can also be freed by deallocate_memory_from_leaf
 
     if (std::strcmp("Char_t", leaf_type_name) == 0){
-        if (singleton) addr = new Char_t;
-        else addr = new Char_t[length];
+        addr = new Char_t[singleton ? 1 : length];
     } else if (std::strcmp("UChar_t", leaf_type_name) == 0){
-        if (singleton) addr = new UChar_t;
-        else addr = new UChar_t[length];
+        addr = new UChar_t[singleton ? 1 : length];
     } else if (std::strcmp("Short_t", leaf_type_name) == 0){
-        if (singleton) addr = new Short_t;
-        else addr = new Short_t[length];
+        addr = new Short_t[singleton ? 1 : length];
     } else if (std::strcmp("UShort_t", leaf_type_name) == 0){
-        if (singleton) addr = new UShort_t;
-        else addr = new UShort_t[length];
+        addr = new UShort_t[singleton ? 1 : length];
     } else if (std::strcmp("Int_t", leaf_type_name) == 0){
-        if (singleton) addr = new Int_t;
-        else addr = new Int_t[length];
+        addr = new Int_t[singleton ? 1 : length];
     } else if (std::strcmp("UInt_t", leaf_type_name) == 0){
-        if (singleton) addr = new UInt_t;
-        else addr = new UInt_t[length];
+        addr = new UInt_t[singleton ? 1 : length];
     } else if (std::strcmp("Float_t", leaf_type_name) == 0){
-        if (singleton) addr = new Float_t;
-        else addr = new Float_t[length];
+        addr = new Float_t[singleton ? 1 : length];
     } else if (std::strcmp("Float16_t", leaf_type_name) == 0){
-        if (singleton) addr = new Float16_t;
-        else addr = new Float16_t[length];
+        addr = new Float16_t[singleton ? 1 : length];
     } else if (std::strcmp("Double_t", leaf_type_name) == 0){
-        if (singleton) addr = new Double_t;
-        else addr = new Double_t[length];
+        addr = new Double_t[singleton ? 1 : length];
     } else if (std::strcmp("Double32_t", leaf_type_name) == 0){
-        if (singleton) addr = new Double32_t;
-        else addr = new Double32_t[length];
+        addr = new Double32_t[singleton ? 1 : length];
     } else if (std::strcmp("Long64_t", leaf_type_name) == 0){
-        if (singleton) addr = new Long64_t;
-        else addr = new Long64_t[length];
+        addr = new Long64_t[singleton ? 1 : length];
     } else if (std::strcmp("ULong64_t", leaf_type_name) == 0){
-        if (singleton) addr = new ULong64_t;
-        else addr = new ULong64_t[length];
+        addr = new ULong64_t[singleton ? 1 : length];
     } else if (std::strcmp("Long_t", leaf_type_name) == 0){
-        if (singleton) addr = new Long_t;
-        else addr = new Long_t[length];
+        addr = new Long_t[singleton ? 1 : length];
     } else if (std::strcmp("ULong_t", leaf_type_name) == 0){
-        if (singleton) addr = new ULong_t();
-        else addr = new ULong_t[length];
+        addr = new ULong_t[singleton ? 1 : length];
     } else if (std::strcmp("Bool_t", leaf_type_name) == 0){
-        if (singleton) addr = new Bool_t();
-        else addr = new Bool_t[length];
+        addr = new Bool_t[singleton ? 1 : length];
     } else {
         throw;
     }
@@ -598,8 +1617,44 @@ void deallocate_memory_from_leaf(const char* leaf_type_name, void* addr){
     else throw;
 }
 
+char get_leaf_type_code(const char* leaf_type_name){
+    // type code of TTree::Branch leaf lists
+    if (std::strcmp("Char_t", leaf_type_name) == 0)
+        return 'B';
+    else if (std::strcmp("UChar_t", leaf_type_name) == 0)
+        return 'b';
+    else if (std::strcmp("Short_t", leaf_type_name) == 0)
+        return 'S';
+    else if (std::strcmp("UShort_t", leaf_type_name) == 0)
+        return 's';
+    else if (std::strcmp("Int_t", leaf_type_name) == 0)
+        return 'I';
+    else if (std::strcmp("UInt_t", leaf_type_name) == 0)
+        return 'i';
+    else if (std::strcmp("Float_t", leaf_type_name) == 0)
+        return 'F';
+    else if (std::strcmp("Float16_t", leaf_type_name) == 0)
+        return 'f';
+    else if (std::strcmp("Double_t", leaf_type_name) == 0)
+        return 'D';
+    else if (std::strcmp("Double32_t", leaf_type_name) == 0)
+        return 'd';
+    else if (std::strcmp("Long64_t", leaf_type_name) == 0)
+        return 'L';
+    else if (std::strcmp("ULong64_t", leaf_type_name) == 0)
+        return 'l';
+    else if (std::strcmp("Long_t", leaf_type_name) == 0)
+        return 'G';
+    else if (std::strcmp("ULong_t", leaf_type_name) == 0)
+        return 'g';
+    else if (std::strcmp("Bool_t", leaf_type_name) == 0)
+        return 'O';
+    else
+        throw;
+}
+
 // from TTree::CloneTree and TTree::CopyAddress
-void append_branches_from_tree(TTree *src_tree, TTree *dst_tree, std::unordered_map<std::string, void*>& data_addresses, const std::string& prefix){
+void append_branches_from_tree(TTree *src_tree, TTree *dst_tree, std::unordered_map<std::string, void*>& data_addresses, const std::string& prefix, const std::unordered_map<std::string, Int_t>* counter_maxima){
     //R__COLLECTION_READ_LOCKGUARD(ROOT::gCoreMutex);
     
     TTree* this_tree = src_tree->GetTree(); // if src_tree is a TChain, this get the current tree
@@ -678,45 +1733,19 @@ void append_branches_from_tree(TTree *src_tree, TTree *dst_tree, std::unordered_
         Int_t length = 1;
         if (!singleton){
             length = src_leaf->GetLeafCount()->GetMaximum();
-            std::cout << "maximum: " << length << std::endl;
+            // maximum over all files if known, so memory is not reallocated when the chain moves to the next file
+            if (counter_maxima){
+                auto it = counter_maxima->find(src_leaf->GetLeafCount()->GetName());
+                if (it != counter_maxima->end()) length = std::max(length, it->second);
+            }
+            if (verbose >= 3) std::cout << "maximum: " << length << std::endl;
         }
 
         // address to hold data on heap, so you're responsible to remove them
         void *data_addr = allocate_memory_from_leaf(src_leaf_type_name, singleton, length); 
 
         // resolve type for leaf list
-        if (std::strcmp("Char_t", src_leaf_type_name) == 0)
-            src_leaf_type = 'B';
-        else if (std::strcmp("UChar_t", src_leaf_type_name) == 0)
-            src_leaf_type = 'b';
-        else if (std::strcmp("Short_t", src_leaf_type_name) == 0)
-            src_leaf_type = 'S';
-        else if (std::strcmp("UShort_t", src_leaf_type_name) == 0)
-            src_leaf_type = 's';
-        else if (std::strcmp("Int_t", src_leaf_type_name) == 0)
-            src_leaf_type = 'I';
-        else if (std::strcmp("UInt_t", src_leaf_type_name) == 0)
-            src_leaf_type = 'i';
-        else if (std::strcmp("Float_t", src_leaf_type_name) == 0)
-            src_leaf_type = 'F';
-        else if (std::strcmp("Float16_t", src_leaf_type_name) == 0)
-            src_leaf_type = 'f';
-        else if (std::strcmp("Double_t", src_leaf_type_name) == 0)
-            src_leaf_type = 'D';
-        else if (std::strcmp("Double32_t", src_leaf_type_name) == 0)
-            src_leaf_type = 'd';
-        else if (std::strcmp("Long64_t", src_leaf_type_name) == 0)
-            src_leaf_type = 'L';
-        else if (std::strcmp("ULong64_t", src_leaf_type_name) == 0)
-            src_leaf_type = 'l';
-        else if (std::strcmp("Long_t", src_leaf_type_name) == 0)
-            src_leaf_type = 'G';
-        else if (std::strcmp("ULong_t", src_leaf_type_name) == 0)
-            src_leaf_type = 'g';
-        else if (std::strcmp("Bool_t", src_leaf_type_name) == 0)
-            src_leaf_type = 'O';
-        else
-            throw;
+        src_leaf_type = get_leaf_type_code(src_leaf_type_name);
         
         // formualte leaflist for dst_tree
         char* dst_leaf_list;
@@ -732,7 +1761,7 @@ void append_branches_from_tree(TTree *src_tree, TTree *dst_tree, std::unordered_
             const char *src_branch_count_name = src_leaf->GetLeafCount()->GetName();
             size_t src_branch_count_name_length = std::strlen(src_branch_count_name);
             dst_leaf_list = new char[dst_branch_name_length + src_branch_count_name_length + prefix_length + 5];
-            std::cout << "leaf count: " << src_branch_count_name << std::endl;
+            if (verbose >= 3) std::cout << "leaf count: " << src_branch_count_name << std::endl;
             for (size_t i = 0; i < dst_branch_name_length; ++i)
                 dst_leaf_list[i] = dst_branch_name[i];
             dst_leaf_list[dst_branch_name_length] = '[';
@@ -760,6 +1789,11 @@ void append_branches_from_tree(TTree *src_tree, TTree *dst_tree, std::unordered_
         if (src_branch_name[0] == 'n'){ 
             ((TLeaf*)(dst_branch->GetListOfLeaves()->At(0)))->IncludeRange(src_leaf);
             //((TLeaf*)(dst_branch->GetListOfLeaves()->At(0)))->SetMaximum(length);
+            TLeafI* dst_counter_leaf = dynamic_cast<TLeafI*>((TLeaf*)(dst_branch->GetListOfLeaves()->At(0)));
+            if (counter_maxima && dst_counter_leaf){
+                auto it = counter_maxima->find(src_branch_name);
+                if ((it != counter_maxima->end()) && (it->second > dst_counter_leaf->GetMaximum())) dst_counter_leaf->SetMaximum(it->second);
+            }
         }
 
         // std::cout << "src: " << src_branch->GetName() << " " << src_branch->GetTitle() << " " << src_branch->GetFullName() << std::endl;
@@ -871,6 +1905,10 @@ void reallocate_memory_if_any(TTree *src_tree, TTree *dst_tree, std::unordered_m
 
         //std::cout << dst_branch_name << std::endl;
         TBranch* dst_branch = dst_tree->GetBranch(dst_branch_name);
+        if (!dst_branch){ // deduplicated, not written to this tree
+            delete[] dst_branch_name;
+            continue;
+        }
         TLeaf* dst_leaf = (TLeaf*)(dst_branch->GetListOfLeaves()->At(0));
         //std::cout << src_branch->GetName() << " " << dst_branch->GetName() << std::endl;
         
@@ -925,3 +1963,1139 @@ Long64_t get_tree_byte_size(TTree* tree){
     TTree::Class()->WriteBuffer(b, tree);
     return b.Length();
 }
+
+std::vector<collection_match_state> append_collection_match_branches(TTree *dst_tree, const std::unordered_map<std::string, void*>& data_addresses){
+    std::vector<collection_match_state> states;
+    states.reserve(collection_match_rules.size()); // keep states in place, branch addresses point into them
+
+    for (const auto& rule : collection_match_rules){
+        collection_match_state state;
+        state.rule = rule;
+        state.datasetA_collection_name = datasetA_branchname_prefix + rule.datasetA_collection;
+        state.datasetB_collection_name = datasetB_branchname_prefix + rule.datasetB_collection;
+
+        // require counter and kinematic branches of both collections
+        bool found_all = true;
+        for (const std::string& collection_name : {state.datasetA_collection_name, state.datasetB_collection_name}){
+            for (const std::string& branch_name : {"n" + collection_name, collection_name + "_pt", collection_name + "_eta", collection_name + "_phi"}){
+                if (data_addresses.find(branch_name) == data_addresses.end()) found_all = false;
+            }
+        }
+        if (!found_all){
+            if (verbose >= 1) std::cout << "Skip object matching " << state.datasetA_collection_name << " <-> " << state.datasetB_collection_name << ", missing branches" << std::endl;
+            continue;
+        }
+        state.datasetA_counter_leaf = (TLeaf*)(dst_tree->GetBranch(("n" + state.datasetA_collection_name).c_str())->GetListOfLeaves()->At(0));
+        state.datasetB_counter_leaf = (TLeaf*)(dst_tree->GetBranch(("n" + state.datasetB_collection_name).c_str())->GetListOfLeaves()->At(0));
+
+        // initial capacity from counter maxima, grown later if needed
+        Int_t datasetA_capacity = std::max(1, state.datasetA_counter_leaf->GetMaximum());
+        Int_t datasetB_capacity = std::max(1, state.datasetB_counter_leaf->GetMaximum());
+        state.datasetA_match_idx.resize(datasetA_capacity);
+        state.datasetA_match_delta_r.resize(datasetA_capacity);
+        state.datasetB_match_idx.resize(datasetB_capacity);
+        state.datasetB_match_delta_r.resize(datasetB_capacity);
+        states.push_back(std::move(state));
+    }
+
+    // create branches, counted by the collection counters already in dst_tree, compressed as the per-branch rules say
+    for (auto& state : states){
+        for (const std::string& collection_name : {state.datasetA_collection_name, state.datasetB_collection_name}){
+            bool is_datasetA = (collection_name == state.datasetA_collection_name);
+            const std::string& collection = is_datasetA ? state.rule.datasetA_collection : state.rule.datasetB_collection;
+            std::string idx_branch_name = collection_name + "_matchIdx";
+            std::string delta_r_branch_name = collection_name + "_matchDeltaR";
+            std::string counter_name = "n" + collection_name;
+            TBranch *idx_branch = dst_tree->Branch(idx_branch_name.c_str(), is_datasetA ? state.datasetA_match_idx.data() : state.datasetB_match_idx.data(), (idx_branch_name + "[" + counter_name + "]/I").c_str());
+            TBranch *delta_r_branch = dst_tree->Branch(delta_r_branch_name.c_str(), is_datasetA ? state.datasetA_match_delta_r.data() : state.datasetB_match_delta_r.data(), (delta_r_branch_name + "[" + counter_name + "]/F").c_str());
+            idx_branch->SetTitle("index of the nearest matched object in the other dataset, -1 if none");
+            delta_r_branch->SetTitle("delta R to the nearest matched object in the other dataset, -1 if none");
+            idx_branch->SetCompressionSettings(get_branch_compression_settings(collection + "_matchIdx"));
+            delta_r_branch->SetCompressionSettings(get_branch_compression_settings(collection + "_matchDeltaR"));
+        }
+    }
+    return states;
+}
+
+void match_collections(collection_match_state& state, const std::unordered_map<std::string, void*>& data_addresses, TTree *out_tree_base, TTree *out_tree){
+    Int_t datasetA_num_objects = Int_t(state.datasetA_counter_leaf->GetValue());
+    Int_t datasetB_num_objects = Int_t(state.datasetB_counter_leaf->GetValue());
+
+    // grow output buffers if needed, both the base and the running tree hold their addresses
+    if ((datasetA_num_objects > Int_t(state.datasetA_match_idx.size())) || (datasetB_num_objects > Int_t(state.datasetB_match_idx.size()))){
+        state.datasetA_match_idx.resize(std::max<size_t>(datasetA_num_objects, state.datasetA_match_idx.size()));
+        state.datasetA_match_delta_r.resize(state.datasetA_match_idx.size());
+        state.datasetB_match_idx.resize(std::max<size_t>(datasetB_num_objects, state.datasetB_match_idx.size()));
+        state.datasetB_match_delta_r.resize(state.datasetB_match_idx.size());
+        for (TTree* tree : {out_tree_base, out_tree}){
+            tree->SetBranchAddress((state.datasetA_collection_name + "_matchIdx").c_str(), state.datasetA_match_idx.data());
+            tree->SetBranchAddress((state.datasetA_collection_name + "_matchDeltaR").c_str(), state.datasetA_match_delta_r.data());
+            tree->SetBranchAddress((state.datasetB_collection_name + "_matchIdx").c_str(), state.datasetB_match_idx.data());
+            tree->SetBranchAddress((state.datasetB_collection_name + "_matchDeltaR").c_str(), state.datasetB_match_delta_r.data());
+        }
+    }
+    state.delta_r2.resize(size_t(datasetA_num_objects) * datasetB_num_objects);
+
+    // input addresses may change when memory is reallocated, so look them up every time
+    const std::string& a = state.datasetA_collection_name;
+    const std::string& b = state.datasetB_collection_name;
+    compute_delta_r_matches(
+        (const Float_t*)data_addresses.at(a + "_pt"), (const Float_t*)data_addresses.at(a + "_eta"), (const Float_t*)data_addresses.at(a + "_phi"), datasetA_num_objects,
+        (const Float_t*)data_addresses.at(b + "_pt"), (const Float_t*)data_addresses.at(b + "_eta"), (const Float_t*)data_addresses.at(b + "_phi"), datasetB_num_objects,
+        state.rule, state.delta_r2.data(),
+        state.datasetA_match_idx.data(), state.datasetA_match_delta_r.data(), state.datasetB_match_idx.data(), state.datasetB_match_delta_r.data());
+}
+
+void compute_delta_r_matches(const Float_t* datasetA_pt, const Float_t* datasetA_eta, const Float_t* datasetA_phi, Int_t datasetA_num_objects, const Float_t* datasetB_pt, const Float_t* datasetB_eta, const Float_t* datasetB_phi, Int_t datasetB_num_objects, const collection_match_rule& rule, Float_t* delta_r2, Int_t* datasetA_match_idx, Float_t* datasetA_match_delta_r, Int_t* datasetB_match_idx, Float_t* datasetB_match_delta_r){
+    constexpr Float_t pi = std::numbers::pi_v<Float_t>;
+    constexpr Float_t unmatched = std::numeric_limits<Float_t>::max();
+    const Float_t max_delta_r2 = rule.max_delta_r * rule.max_delta_r;
+    const bool use_min_pt_ratio = (rule.min_pt_ratio > 0);
+    const bool use_max_pt_ratio = (rule.max_pt_ratio > 0);
+
+    // delta R^2 matrix, collections are already stored as structure of arrays so the inner loop vectorizes
+    for (Int_t i = 0; i < datasetA_num_objects; ++i){
+        const Float_t pt_i = datasetA_pt[i];
+        const Float_t eta_i = datasetA_eta[i];
+        const Float_t phi_i = datasetA_phi[i];
+        Float_t *row = delta_r2 + size_t(i) * datasetB_num_objects;
+        #pragma omp simd
+        for (Int_t j = 0; j < datasetB_num_objects; ++j){
+            Float_t delta_eta = eta_i - datasetB_eta[j];
+            Float_t delta_phi = std::fabs(phi_i - datasetB_phi[j]);
+            delta_phi = (delta_phi > pi) ? 2 * pi - delta_phi : delta_phi;
+            Float_t dr2 = delta_eta * delta_eta + delta_phi * delta_phi;
+            Float_t pt_ratio = datasetB_pt[j] / pt_i;
+            bool pass = (dr2 < max_delta_r2) && (!use_min_pt_ratio || (pt_ratio >= rule.min_pt_ratio)) && (!use_max_pt_ratio || (pt_ratio <= rule.max_pt_ratio));
+            row[j] = pass ? dr2 : unmatched;
+        }
+    }
+
+    // nearest neighbour in both directions, row minimum for datasetA and column minimum for datasetB
+    std::fill(datasetB_match_idx, datasetB_match_idx + datasetB_num_objects, -1);
+    std::fill(datasetB_match_delta_r, datasetB_match_delta_r + datasetB_num_objects, unmatched);
+    for (Int_t i = 0; i < datasetA_num_objects; ++i){
+        const Float_t *row = delta_r2 + size_t(i) * datasetB_num_objects;
+        Int_t best_idx = -1;
+        Float_t best_dr2 = unmatched;
+        for (Int_t j = 0; j < datasetB_num_objects; ++j){
+            if (row[j] < best_dr2){
+                best_dr2 = row[j];
+                best_idx = j;
+            }
+        }
+        datasetA_match_idx[i] = best_idx;
+        datasetA_match_delta_r[i] = (best_idx != -1) ? std::sqrt(best_dr2) : -1;
+
+        #pragma omp simd
+        for (Int_t j = 0; j < datasetB_num_objects; ++j){
+            bool is_better = row[j] < datasetB_match_delta_r[j]; // holds delta R^2 until the end
+            datasetB_match_delta_r[j] = is_better ? row[j] : datasetB_match_delta_r[j];
+            datasetB_match_idx[j] = is_better ? i : datasetB_match_idx[j];
+        }
+    }
+    for (Int_t j = 0; j < datasetB_num_objects; ++j)
+        datasetB_match_delta_r[j] = (datasetB_match_idx[j] != -1) ? std::sqrt(datasetB_match_delta_r[j]) : -1;
+}
+
+void build_event_filters(TTreeReader& long_chain_reader, TTreeReader& short_chain_reader, bool is_swapped, event_filter& long_chain_filter, event_filter& short_chain_filter, event_filter& joined_chain_filter){
+    // datasetA is the short chain unless chains were swapped
+    TTreeReader& datasetA_reader = is_swapped ? long_chain_reader : short_chain_reader;
+    TTreeReader& datasetB_reader = is_swapped ? short_chain_reader : long_chain_reader;
+    event_filter datasetA_chain_filter = datasetA_filter ? datasetA_filter(datasetA_reader) : nullptr;
+    event_filter datasetB_chain_filter = datasetB_filter ? datasetB_filter(datasetB_reader) : nullptr;
+
+    long_chain_filter = is_swapped ? datasetA_chain_filter : datasetB_chain_filter;
+    short_chain_filter = is_swapped ? datasetB_chain_filter : datasetA_chain_filter;
+    joined_chain_filter = joined_filter ? joined_filter(datasetA_reader, datasetB_reader) : nullptr;
+}
+
+bool pass_event_filters(const event_filter& long_chain_filter, const event_filter& short_chain_filter, const event_filter& joined_chain_filter){
+    // readers must already be at the matched entries, stop at the first failing filter to avoid further reads
+    if (long_chain_filter && !long_chain_filter()) return false;
+    if (short_chain_filter && !short_chain_filter()) return false;
+    if (joined_chain_filter && !joined_chain_filter()) return false;
+    return true;
+}
+
+std::string get_dst_branch_name(const char* src_branch_name, const std::string& prefix){
+    // counter branches keep the leading 'n', e.g. nJet -> n1.Jet
+    if (src_branch_name[0] == 'n') return "n" + prefix + (src_branch_name + 1);
+    return prefix + src_branch_name;
+}
+
+Double_t get_tree_bytes_per_entry(TTree *src_tree, bool is_compressed){
+    TTree* this_tree = src_tree->GetTree(); // if src_tree is a TChain, this get the current tree
+    if (!this_tree || this_tree->GetEntries() == 0) return 0;
+
+    // sum uncompressed (or compressed) bytes per entry over active branches
+    Double_t bytes_per_entry = 0;
+    TObjArray* src_branches = this_tree->GetListOfBranches();
+    Int_t num_src_branches = src_branches->GetEntriesFast();
+    for (Int_t i_src_branch = 0; i_src_branch < num_src_branches; ++i_src_branch) {
+        TBranch* src_branch = (TBranch*)(src_branches->At(i_src_branch));
+        if (src_branch->TestBit(kDoNotProcess)) continue; // skip inactive branch
+        bytes_per_entry += Double_t(is_compressed ? src_branch->GetZipBytes() : src_branch->GetTotBytes()) / this_tree->GetEntries();
+    }
+    return bytes_per_entry;
+}
+
+Long64_t get_cluster_num_entries(Double_t bytes_per_entry){
+    // number of entries per cluster such that each cluster holds about out_cluster_target_size bytes
+    if (bytes_per_entry <= 0) return -out_cluster_target_size; // fall back to ROOT byte-based auto-flush
+    return std::max<Long64_t>(1, Long64_t(out_cluster_target_size / bytes_per_entry));
+}
+
+Int_t get_branch_compression_settings(const std::string& branch_name){
+    // first matching rule wins
+    for (const auto& rule : out_branch_compression_rules){
+        if (TString(branch_name.c_str()).Index(TRegexp(rule.branchname_pattern.c_str(), kTRUE)) != -1) return ROOT::CompressionSettings(rule.algorithm, rule.level);
+    }
+    return ROOT::CompressionSettings(out_compression_algorithm, out_compression_level);
+}
+
+void configure_output_branches(TTree *src_tree, TTree *dst_tree, const std::string& prefix, Long64_t cluster_num_entries){
+    TTree* this_tree = src_tree->GetTree(); // if src_tree is a TChain, this get the current tree
+    Long64_t src_num_entries = this_tree->GetEntries();
+
+    TObjArray* src_branches = this_tree->GetListOfBranches();
+    Int_t num_src_branches = src_branches->GetEntriesFast();
+    for (Int_t i_src_branch = 0; i_src_branch < num_src_branches; ++i_src_branch) {
+        TBranch* src_branch = (TBranch*)(src_branches->At(i_src_branch));
+        if (src_branch->TestBit(kDoNotProcess)) continue; // skip inactive branch
+
+        TBranch* dst_branch = dst_tree->GetBranch(get_dst_branch_name(src_branch->GetName(), prefix).c_str());
+        if (!dst_branch) continue;
+
+        dst_branch->SetCompressionSettings(get_branch_compression_settings(src_branch->GetName()));
+
+        // basket size, aim for one basket per branch per cluster
+        if ((src_num_entries > 0) && (cluster_num_entries > 0)){
+            Double_t bytes_per_entry = Double_t(src_branch->GetTotBytes()) / src_num_entries;
+            Long64_t basket_size = Long64_t(bytes_per_entry * cluster_num_entries);
+            basket_size = std::clamp<Long64_t>(basket_size, out_basket_min_size, out_basket_max_size);
+            basket_size = (basket_size + 511) / 512 * 512; // round up to multiple of 512 bytes
+            dst_branch->SetBasketSize(Int_t(basket_size));
+        }
+        if (verbose >= 3) std::cout << "branch " << dst_branch->GetName() << ": compression " << dst_branch->GetCompressionSettings() << ", basket size " << dst_branch->GetBasketSize() << std::endl;
+    }
+}
+
+void read_block_columns(TChain *chain, const std::vector<Long64_t>& entries, const std::string& prefix, std::unordered_map<std::string, block_column>& columns, Int_t& saved_tree_number, TTree *out_tree_base, TTree *out_tree, std::unordered_map<std::string, void*>& data_addresses, file_stager *stager){
+    Long64_t num_rows = entries.size();
+
+    // visit rows in entry order, so each file is loaded once and its baskets are read forward
+    std::vector<Long64_t> rows(num_rows);
+    std::iota(rows.begin(), rows.end(), 0);
+    std::stable_sort(rows.begin(), rows.end(), [&](Long64_t a, Long64_t b){ return entries[a] < entries[b]; });
+
+    Long64_t i_begin = 0;
+    while (i_begin < num_rows){
+        chain->LoadTree(entries[rows[i_begin]]);
+        Int_t tree_number = chain->GetTreeNumber();
+        if (stager) stager->update(tree_number);
+        if (tree_number != saved_tree_number){ // we might need to re-allocate memory
+            reallocate_memory_if_any(chain, out_tree_base, data_addresses, prefix);
+            reallocate_memory_if_any(chain, out_tree, data_addresses, prefix);
+            saved_tree_number = tree_number;
+        }
+
+        // rows in this tree
+        TTree* this_tree = chain->GetTree();
+        Long64_t tree_offset = chain->GetTreeOffset()[tree_number];
+        Long64_t i_end = i_begin;
+        while ((i_end < num_rows) && (entries[rows[i_end]] < tree_offset + this_tree->GetEntries())) i_end++;
+
+        // branch by branch, each basket is decompressed once and consumed before moving on
+        TObjArray* src_branches = this_tree->GetListOfBranches();
+        Int_t num_src_branches = src_branches->GetEntriesFast();
+        for (Int_t i_src_branch = 0; i_src_branch < num_src_branches; ++i_src_branch) {
+            TBranch* src_branch = (TBranch*)(src_branches->At(i_src_branch));
+            if (src_branch->TestBit(kDoNotProcess)) continue; // skip inactive branch
+            TLeaf* src_leaf = (TLeaf*) src_branch->GetListOfLeaves()->At(0);
+
+            auto [it, is_new_column] = columns.try_emplace(get_dst_branch_name(src_branch->GetName(), prefix));
+            block_column& column = it->second;
+            if (is_new_column){
+                column.row_offsets.assign(num_rows, 0);
+                column.row_sizes.assign(num_rows, 0);
+            }
+
+            for (Long64_t i_row = i_begin; i_row < i_end; ++i_row){
+                Long64_t row = rows[i_row];
+                src_branch->GetEntry(entries[row] - tree_offset); // array leaves re-read their counter for this entry if needed
+                size_t num_bytes = size_t(src_leaf->GetLen()) * src_leaf->GetLenType();
+                const char* value = (const char*) src_leaf->GetValuePointer();
+                column.row_offsets[row] = column.data.size();
+                column.row_sizes[row] = num_bytes;
+                column.data.insert(column.data.end(), value, value + num_bytes);
+            }
+        }
+        i_begin = i_end;
+    }
+}
+
+Long64_t write_block_columns(TTree *out_tree, std::unordered_map<std::string, block_column>& columns, std::unordered_map<std::string, void*>& data_addresses, std::vector<collection_match_state>& collection_match_states, TTree *out_tree_base, Long64_t num_rows){
+    Long64_t num_bytes = 0;
+
+    std::vector<std::pair<const block_column*, void*>> row_columns;
+    for (const auto& [dst_branch_name, column] : columns){
+        auto it = data_addresses.find(dst_branch_name);
+        if (it != data_addresses.end()) row_columns.emplace_back(&column, it->second);
+    }
+
+    // row by row in probe order through TTree::Fill, so entries, byte totals, auto-flush and auto-save are kept by the tree
+    for (Long64_t row = 0; row < num_rows; ++row){
+        for (const auto& [column, data_addr] : row_columns) restore_block_row(*column, row, data_addr);
+        for (auto& state : collection_match_states)
+            match_collections(state, data_addresses, out_tree_base, out_tree);
+        Int_t num_byte_write = out_tree->Fill();
+        if (num_byte_write > 0) num_bytes += num_byte_write;
+    }
+    return num_bytes;
+}
+
+void restore_block_row(const block_column& column, Long64_t row, void* data_addr){
+    std::memcpy(data_addr, column.data.data() + column.row_offsets[row], column.row_sizes[row]);
+}
+
+std::vector<shared_column> find_shared_columns(TChain *long_chain, TChain *short_chain, const std::string& long_chain_branchname_prefix, const std::string& short_chain_branchname_prefix, bool is_swapped, const event_index *short_chain_index, std::unordered_map<std::string, void*>& data_addresses, TTree *out_tree_base, Int_t& long_chain_saved_tree_number, Int_t& short_chain_saved_tree_number){
+    std::vector<shared_column> shared_columns;
+    TTree* long_tree = long_chain->GetTree();
+    TTree* short_tree = short_chain->GetTree();
+    const std::string& datasetA_prefix = is_swapped ? long_chain_branchname_prefix : short_chain_branchname_prefix;
+    const std::string& datasetB_prefix = is_swapped ? short_chain_branchname_prefix : long_chain_branchname_prefix;
+
+    // counters stay in both datasets, arrays kept in either one need them
+    std::set<std::string> counter_names;
+    for (TTree* tree : {long_tree, short_tree}){
+        TObjArray* leaves = tree->GetListOfLeaves();
+        for (Int_t i_leaf = 0; i_leaf < leaves->GetEntriesFast(); ++i_leaf){
+            TLeaf* leaf_count = ((TLeaf*) leaves->At(i_leaf))->GetLeafCount();
+            if (leaf_count) counter_names.insert(leaf_count->GetName());
+        }
+    }
+
+    // candidates, active in both datasets with the same layout
+    TObjArray* long_branches = long_tree->GetListOfBranches();
+    for (Int_t i_branch = 0; i_branch < long_branches->GetEntriesFast(); ++i_branch){
+        TBranch* long_branch = (TBranch*) long_branches->At(i_branch);
+        TBranch* short_branch = short_tree->GetBranch(long_branch->GetName());
+        if (!short_branch || long_branch->TestBit(kDoNotProcess) || short_branch->TestBit(kDoNotProcess)) continue;
+        if (counter_names.count(long_branch->GetName())) continue;
+        TLeaf* long_leaf = (TLeaf*) long_branch->GetListOfLeaves()->At(0);
+        TLeaf* short_leaf = (TLeaf*) short_branch->GetListOfLeaves()->At(0);
+        if (std::strcmp(long_leaf->GetTypeName(), short_leaf->GetTypeName()) != 0) continue;
+        if ((!long_leaf->GetLeafCount() != !short_leaf->GetLeafCount()) || (long_leaf->GetLenStatic() != short_leaf->GetLenStatic())) continue;
+
+        shared_column column;
+        column.kept_branch_name = get_dst_branch_name(long_branch->GetName(), datasetA_prefix);
+        column.aliased_branch_name = get_dst_branch_name(long_branch->GetName(), datasetB_prefix);
+        if (long_leaf->GetLeafCount()){
+            column.kept_counter_name = get_dst_branch_name(long_leaf->GetLeafCount()->GetName(), datasetA_prefix);
+            column.aliased_counter_name = get_dst_branch_name(long_leaf->GetLeafCount()->GetName(), datasetB_prefix);
+        }
+        column.type_size = long_leaf->GetLenType() * long_leaf->GetLenStatic();
+        shared_columns.push_back(column);
+    }
+
+    // sample matched events from the start of the long chain, only run and event are read for unmatched entries
+    Long64_t num_sampled = 0;
+    Long64_t max_entries = std::min(long_chain->GetEntries(), dedup_sample_max_entries);
+    const UInt_t* run = (const UInt_t*) data_addresses.at(long_chain_branchname_prefix + "run");
+    const ULong64_t* event_number = (const ULong64_t*) data_addresses.at(long_chain_branchname_prefix + "event");
+    for (Long64_t i_long_chain = 0; (i_long_chain < max_entries) && (num_sampled < dedup_sample_size); ++i_long_chain){
+        Long64_t local_entry = long_chain->LoadTree(i_long_chain);
+        if (long_chain->GetTreeNumber() != long_chain_saved_tree_number){
+            reallocate_memory_if_any(long_chain, out_tree_base, data_addresses, long_chain_branchname_prefix);
+            long_chain_saved_tree_number = long_chain->GetTreeNumber();
+            run = (const UInt_t*) data_addresses.at(long_chain_branchname_prefix + "run");
+            event_number = (const ULong64_t*) data_addresses.at(long_chain_branchname_prefix + "event");
+        }
+        long_chain->GetTree()->GetBranch("run")->GetEntry(local_entry);
+        long_chain->GetTree()->GetBranch("event")->GetEntry(local_entry);
+        Long64_t i_short_chain = get_entry_number_with_index(short_chain, short_chain_index, *run, *event_number);
+        if (i_short_chain == -1) continue;
+
+        short_chain->LoadTree(i_short_chain);
+        if (short_chain->GetTreeNumber() != short_chain_saved_tree_number){
+            reallocate_memory_if_any(short_chain, out_tree_base, data_addresses, short_chain_branchname_prefix);
+            short_chain_saved_tree_number = short_chain->GetTreeNumber();
+        }
+        long_chain->GetEntry(i_long_chain);
+        short_chain->GetEntry(i_short_chain);
+        check_shared_columns(shared_columns, data_addresses);
+        num_sampled++;
+    }
+
+    std::erase_if(shared_columns, [&](const shared_column& column){ return (!column.is_shared) || (num_sampled == 0); });
+    if (verbose >= 3) std::cout << "Deduplication sample: " << num_sampled << " matched events" << std::endl;
+    return shared_columns;
+}
+
+Int_t check_shared_columns(std::vector<shared_column>& shared_columns, const std::unordered_map<std::string, void*>& data_addresses){
+    Int_t num_diverged = 0;
+    for (auto& column : shared_columns){
+        if (!column.is_shared) continue;
+        size_t kept_size = column.type_size * (column.kept_counter_name.empty() ? 1 : *(const Int_t*) data_addresses.at(column.kept_counter_name));
+        size_t aliased_size = column.type_size * (column.aliased_counter_name.empty() ? 1 : *(const Int_t*) data_addresses.at(column.aliased_counter_name));
+        if ((kept_size != aliased_size) || (std::memcmp(data_addresses.at(column.kept_branch_name), data_addresses.at(column.aliased_branch_name), kept_size) != 0)){
+            if (verbose >= 3) std::cout << "Deduplicated branch diverged: " << column.aliased_branch_name << std::endl;
+            column.is_shared = false;
+            num_diverged++;
+        }
+    }
+    return num_diverged;
+}
+
+Int_t check_shared_columns_in_block(std::vector<shared_column>& shared_columns, const std::unordered_map<std::string, block_column>& columns, Long64_t num_rows){
+    Int_t num_diverged = 0;
+    for (auto& column : shared_columns){
+        if (!column.is_shared) continue;
+        // branches can be missing from the files of a block, skip if missing in both, diverged if missing in one
+        auto kept_it = columns.find(column.kept_branch_name);
+        auto aliased_it = columns.find(column.aliased_branch_name);
+        if ((kept_it == columns.end()) && (aliased_it == columns.end())) continue;
+        bool is_diverged = (kept_it == columns.end()) || (aliased_it == columns.end());
+        for (Long64_t row = 0; (row < num_rows) && !is_diverged; ++row){
+            const block_column& kept_column = kept_it->second;
+            const block_column& aliased_column = aliased_it->second;
+            size_t size = kept_column.row_sizes[row];
+            is_diverged = (size != aliased_column.row_sizes[row]) || (std::memcmp(kept_column.data.data() + kept_column.row_offsets[row], aliased_column.data.data() + aliased_column.row_offsets[row], size) != 0);
+        }
+        if (is_diverged){
+            if (verbose >= 3) std::cout << "Deduplicated branch diverged: " << column.aliased_branch_name << std::endl;
+            column.is_shared = false;
+            num_diverged++;
+        }
+    }
+    return num_diverged;
+}
+
+void add_diverged_branches(TTree *out_tree, TTree *out_tree_base, const std::vector<shared_column>& shared_columns, std::unordered_map<std::string, void*>& data_addresses){
+    Long64_t num_entries = out_tree->GetEntries();
+    for (const auto& column : shared_columns){
+        if (column.is_shared || out_tree->GetBranch(column.aliased_branch_name.c_str())) continue;
+
+        // datasetB branch as in out_tree_base, replacing the alias
+        TBranch* base_branch = out_tree_base->GetBranch(column.aliased_branch_name.c_str());
+        TLeaf* base_leaf = (TLeaf*) base_branch->GetListOfLeaves()->At(0);
+        std::string leaf_list = column.aliased_branch_name + (column.aliased_counter_name.empty() ? "" : "[" + column.aliased_counter_name + "]") + "/" + get_leaf_type_code(base_leaf->GetTypeName());
+        void* aliased_addr = data_addresses.at(column.aliased_branch_name);
+        TBranch* aliased_branch = out_tree->Branch(column.aliased_branch_name.c_str(), aliased_addr, leaf_list.c_str(), base_branch->GetBasketSize());
+        aliased_branch->SetTitle(base_branch->GetTitle());
+        aliased_branch->SetCompressionSettings(base_branch->GetCompressionSettings());
+        if (TList* aliases = out_tree->GetListOfAliases()){
+            TObject* alias = aliases->FindObject(column.aliased_branch_name.c_str());
+            if (alias){
+                aliases->Remove(alias);
+                delete alias;
+            }
+        }
+
+        // entries already written were identical, read them back from the datasetA branch into the datasetB buffers,
+        // the counter buffers of the current event are overwritten on the way and restored afterwards
+        TBranch* kept_branch = out_tree->GetBranch(column.kept_branch_name.c_str());
+        Int_t* kept_counter = column.kept_counter_name.empty() ? nullptr : (Int_t*) data_addresses.at(column.kept_counter_name);
+        Int_t* aliased_counter = column.aliased_counter_name.empty() ? nullptr : (Int_t*) data_addresses.at(column.aliased_counter_name);
+        Int_t saved_kept_counter = kept_counter ? *kept_counter : 0;
+        Int_t saved_aliased_counter = aliased_counter ? *aliased_counter : 0;
+        std::vector<char> saved_value((aliased_counter ? saved_aliased_counter : 1) * column.type_size);
+        std::memcpy(saved_value.data(), aliased_addr, saved_value.size());
+        kept_branch->SetAddress(aliased_addr);
+        for (Long64_t entry = 0; entry < num_entries; ++entry){
+            kept_branch->GetEntry(entry); // array leaves read their counter for this entry
+            if (aliased_counter) *aliased_counter = *kept_counter;
+            aliased_branch->Fill();
+        }
+        kept_branch->SetAddress(data_addresses.at(column.kept_branch_name));
+        if (kept_counter) *kept_counter = saved_kept_counter;
+        if (aliased_counter) *aliased_counter = saved_aliased_counter;
+        std::memcpy(aliased_addr, saved_value.data(), saved_value.size());
+        if (verbose >= 3) std::cout << "Deduplicated branch diverged, " << column.aliased_branch_name << " added with " << num_entries << " entries filled back" << std::endl;
+    }
+}
+
+TTree* clone_out_tree(TTree *out_tree_base, const std::vector<shared_column>& shared_columns){
+    // only active branches are cloned
+    for (const auto& column : shared_columns)
+        out_tree_base->SetBranchStatus(column.aliased_branch_name.c_str(), !column.is_shared);
+    TTree* out_tree = out_tree_base->CloneTree(0);
+    for (const auto& column : shared_columns){
+        if (column.is_shared) out_tree->SetAlias(column.aliased_branch_name.c_str(), column.kept_branch_name.c_str());
+    }
+    return out_tree;
+}
+
+void event_index::build(TChain *chain){
+    // key pass, only run and event are read
+    std::vector<index_entry> keys;
+    keys.reserve(chain->GetEntries());
+    TTreeReader reader(chain);
+    TTreeReaderValue<UInt_t> run(reader, "run");
+    TTreeReaderValue<ULong64_t> event_number(reader, "event");
+    while (reader.Next())
+        keys.push_back({*run, *event_number, reader.GetCurrentEntry()});
+    build(std::move(keys));
+}
+
+void event_index::build(std::vector<index_entry> keys){
+    runs.clear();
+    block_first_event_numbers.clear();
+    blocks.clear();
+    packed_words.clear();
+    num_bits = 0;
+    is_compact = use_compact_index;
+
+    // sorted in place, duplicated keys keep their first entry
+    entries = std::move(keys);
+    std::sort(entries.begin(), entries.end(), [](const index_entry& a, const index_entry& b){
+        if (a.run != b.run) return a.run < b.run;
+        return (a.event_number != b.event_number) ? (a.event_number < b.event_number) : (a.entry_number < b.entry_number);
+    });
+    num_entries = entries.size();
+    if (!is_compact) return;
+
+    // compact layout, each run is encoded in blocks, then the keys are released
+    entries.erase(std::unique(entries.begin(), entries.end(), [](const index_entry& a, const index_entry& b){
+        return (a.run == b.run) && (a.event_number == b.event_number);
+    }), entries.end());
+    num_entries = entries.size();
+    size_t block_size = std::clamp(compact_index_block_size, 1, 65535);
+    for (size_t i_run_begin = 0, i_run_end = 0; i_run_begin < entries.size(); i_run_begin = i_run_end){
+        UInt_t this_run = entries[i_run_begin].run;
+        while ((i_run_end < entries.size()) && (entries[i_run_end].run == this_run)) i_run_end++;
+        runs.push_back({this_run, UInt_t(blocks.size())});
+
+        for (size_t i_begin = i_run_begin; i_begin < i_run_end; i_begin += block_size){
+            size_t i_end = std::min(i_begin + block_size, i_run_end);
+            ULong64_t first_event_number = entries[i_begin].event_number;
+            Long64_t min_entry_number = entries[i_begin].entry_number;
+            Long64_t max_entry_number = entries[i_begin].entry_number;
+            for (size_t i = i_begin; i < i_end; ++i){
+                min_entry_number = std::min(min_entry_number, entries[i].entry_number);
+                max_entry_number = std::max(max_entry_number, entries[i].entry_number);
+            }
+
+            block_header block;
+            block.first_entry_number = min_entry_number;
+            block.bit_offset = num_bits;
+            block.num_events = i_end - i_begin;
+            block.event_number_width = std::bit_width(entries[i_end-1].event_number - first_event_number);
+            block.entry_number_width = std::bit_width(ULong64_t(max_entry_number - min_entry_number));
+            for (size_t i = i_begin; i < i_end; ++i) append_packed(entries[i].event_number - first_event_number, block.event_number_width);
+            for (size_t i = i_begin; i < i_end; ++i) append_packed(entries[i].entry_number - min_entry_number, block.entry_number_width);
+            blocks.push_back(block);
+            block_first_event_numbers.push_back(first_event_number);
+        }
+    }
+    std::vector<index_entry>().swap(entries);
+    packed_words.shrink_to_fit();
+    blocks.shrink_to_fit();
+    block_first_event_numbers.shrink_to_fit();
+}
+
+Long64_t event_index::get_entry_number(UInt_t run, ULong64_t event_number) const {
+    if (is_compact) return get_compact_entry_number(run, event_number);
+    auto it = std::lower_bound(entries.begin(), entries.end(), std::make_pair(run, event_number), [](const index_entry& entry, const std::pair<UInt_t, ULong64_t>& key){
+        return (entry.run != key.first) ? (entry.run < key.first) : (entry.event_number < key.second);
+    });
+    if ((it == entries.end()) || (it->run != run) || (it->event_number != event_number)) return -1;
+    return it->entry_number;
+}
+
+Long64_t event_index::get_num_bytes() const {
+    if (!is_compact) return entries.size() * sizeof(index_entry);
+    return runs.size() * sizeof(run_entry) + blocks.size() * (sizeof(block_header) + sizeof(ULong64_t)) + packed_words.size() * sizeof(ULong64_t);
+}
+
+Long64_t event_index::get_compact_entry_number(UInt_t run, ULong64_t event_number) const {
+    // run directory
+    auto run_it = std::lower_bound(runs.begin(), runs.end(), run, [](const run_entry& entry, UInt_t key){ return entry.run < key; });
+    if ((run_it == runs.end()) || (run_it->run != run)) return -1;
+    size_t first_block = run_it->first_block;
+    size_t end_block = (run_it + 1 == runs.end()) ? blocks.size() : (run_it + 1)->first_block;
+
+    // last block of the run starting at or before event_number
+    auto block_it = std::upper_bound(block_first_event_numbers.begin() + first_block, block_first_event_numbers.begin() + end_block, event_number);
+    if (block_it == block_first_event_numbers.begin() + first_block) return -1;
+    size_t i_block = block_it - block_first_event_numbers.begin() - 1;
+    const block_header& block = blocks[i_block];
+    ULong64_t event_number_offset = event_number - block_first_event_numbers[i_block];
+    if ((block.event_number_width < 64) && ((event_number_offset >> block.event_number_width) != 0)) return -1;
+
+    // binary search on the packed offsets, they are sorted as the event numbers
+    Int_t low = 0, high = block.num_events;
+    while (low < high){
+        Int_t mid = (low + high) / 2;
+        if (read_packed(block.bit_offset + ULong64_t(mid) * block.event_number_width, block.event_number_width) < event_number_offset) low = mid + 1;
+        else high = mid;
+    }
+    if ((low == block.num_events) || (read_packed(block.bit_offset + ULong64_t(low) * block.event_number_width, block.event_number_width) != event_number_offset)) return -1;
+    ULong64_t entry_number_bit_offset = block.bit_offset + ULong64_t(block.num_events) * block.event_number_width;
+    return block.first_entry_number + read_packed(entry_number_bit_offset + ULong64_t(low) * block.entry_number_width, block.entry_number_width);
+}
+
+void event_index::append_packed(ULong64_t value, int width){
+    if (width == 0) return;
+    size_t i_word = num_bits >> 6;
+    int shift = num_bits & 63;
+    if (i_word == packed_words.size()) packed_words.push_back(0);
+    packed_words[i_word] |= value << shift;
+    if (shift + width > 64) packed_words.push_back(value >> (64 - shift)); // spills into the next word
+    num_bits += width;
+}
+
+ULong64_t event_index::read_packed(ULong64_t bit_offset, int width) const {
+    if (width == 0) return 0;
+    size_t i_word = bit_offset >> 6;
+    int shift = bit_offset & 63;
+    ULong64_t value = packed_words[i_word] >> shift;
+    if (shift + width > 64) value |= packed_words[i_word + 1] << (64 - shift);
+    return (width == 64) ? value : (value & ((ULong64_t(1) << width) - 1));
+}
+
+Long64_t get_entry_number_with_index(TChain *chain, const event_index *index, UInt_t run, ULong64_t event_number){
+    return index ? index->get_entry_number(run, event_number) : chain->GetEntryNumberWithIndex(run, event_number);
+}
+
+#ifdef NANOAOD_MATCHING_SELF_CHECK
+bool check_event_index(){
+    // synthetic keys in random entry order: consecutive events, a run of one event, sparse 64-bit event numbers and duplicates
+    std::mt19937_64 generator(1);
+    std::vector<event_index::index_entry> keys;
+    Long64_t entry_number = 0;
+    for (ULong64_t event_number = 0; event_number < 1000; ++event_number) keys.push_back({1, event_number, entry_number++});
+    keys.push_back({2, 42, entry_number++});
+    for (int i = 0; i < 1000; ++i) keys.push_back({3, generator(), entry_number++});
+    for (int i = 0; i < 300; ++i) keys.push_back({5, ULong64_t(i % 7), entry_number++});
+    std::shuffle(keys.begin(), keys.end(), generator);
+
+    // every key, its neighbours and the same event in the next run, plus keys outside every run
+    std::vector<std::pair<UInt_t, ULong64_t>> queries = {{0, 0}, {std::numeric_limits<UInt_t>::max(), std::numeric_limits<ULong64_t>::max()}};
+    for (const auto& key : keys){
+        queries.emplace_back(key.run, key.event_number);
+        queries.emplace_back(key.run, key.event_number + 1);
+        queries.emplace_back(key.run, key.event_number - 1);
+        queries.emplace_back(key.run + 1, key.event_number);
+    }
+
+    // compact layout against the plain sorted index, one-event blocks give zero bit widths
+    bool saved_use_compact_index = use_compact_index;
+    int saved_compact_index_block_size = compact_index_block_size;
+    use_compact_index = false;
+    event_index plain_index;
+    plain_index.build(keys);
+    Long64_t num_mismatches = 0;
+    for (int block_size : {1, 2, 3, 128, 65535}){
+        use_compact_index = true;
+        compact_index_block_size = block_size;
+        event_index compact_index;
+        compact_index.build(keys);
+        Long64_t num_block_mismatches = 0;
+        for (const auto& [run, event_number] : queries){
+            if (compact_index.get_entry_number(run, event_number) != plain_index.get_entry_number(run, event_number)) num_block_mismatches++;
+        }
+        std::cout << std::format("Block size {}: {} keys, {:.02f} bytes per entry, {} mismatches over {} lookups", block_size, compact_index.size(),
+                                 Double_t(compact_index.get_num_bytes()) / compact_index.size(), num_block_mismatches, queries.size()) << std::endl;
+        num_mismatches += num_block_mismatches;
+    }
+    use_compact_index = saved_use_compact_index;
+    compact_index_block_size = saved_compact_index_block_size;
+    return num_mismatches == 0;
+}
+
+bool check_delta_r_matches(){
+    // synthetic collections: expected nearest index and delta R in both directions, -1 if none
+    struct delta_r_case {
+        const char* name;
+        collection_match_rule rule;
+        std::vector<Float_t> datasetA_pt, datasetA_eta, datasetA_phi;
+        std::vector<Float_t> datasetB_pt, datasetB_eta, datasetB_phi;
+        std::vector<Int_t> datasetA_match_idx, datasetB_match_idx;
+        std::vector<Float_t> datasetA_match_delta_r, datasetB_match_delta_r;
+    };
+    constexpr Float_t pi = std::numbers::pi_v<Float_t>;
+    const std::vector<delta_r_case> cases = {
+        {"phi wrap-around", {"Jet", "Jet", 0.4, 0., 0.}, {20}, {0.5}, {pi - 0.05f}, {20}, {0.5}, {-pi + 0.05f}, {0}, {0}, {0.1f}, {0.1f}},
+        {"empty datasetA", {"Jet", "Jet", 0.4, 0., 0.}, {}, {}, {}, {20, 30}, {0, 1}, {0, 1}, {}, {-1, -1}, {}, {-1, -1}},
+        {"empty datasetB", {"Jet", "Jet", 0.4, 0., 0.}, {20, 30}, {0, 1}, {0, 1}, {}, {}, {}, {-1, -1}, {}, {-1, -1}, {}},
+        {"both empty", {"Jet", "Jet", 0.4, 0., 0.}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {}},
+        {"pt ratio with pt 0", {"Muon", "Muon", 0.4, 0.5, 2.}, {0, 0, 10}, {0, 2, -2}, {0, 0, 0}, {10, 0, 15}, {0, 2, -2}, {0, 0, 0}, {-1, -1, 2}, {-1, -1, 2}, {-1, -1, 0}, {-1, -1, 0}},
+        {"pt 0 without ratio cut", {"Muon", "Muon", 0.4, 0., 0.}, {0}, {0}, {0}, {0}, {0.1f}, {0}, {0}, {0}, {0.1f}, {0.1f}},
+        {"one-to-many", {"Jet", "Jet", 0.4, 0., 0.}, {20, 25}, {0, 0.05f}, {0, 0}, {20, 21, 22}, {0.3f, 0.1f, 0.2f}, {0, 0, 0}, {1, 1}, {1, 1, 1}, {0.1f, 0.05f}, {0.25f, 0.05f, 0.15f}},
+    };
+
+    Int_t num_failed = 0;
+    for (const auto& test_case : cases){
+        Int_t datasetA_num_objects = test_case.datasetA_pt.size();
+        Int_t datasetB_num_objects = test_case.datasetB_pt.size();
+        std::vector<Float_t> delta_r2(size_t(datasetA_num_objects) * datasetB_num_objects);
+        std::vector<Int_t> datasetA_match_idx(datasetA_num_objects), datasetB_match_idx(datasetB_num_objects);
+        std::vector<Float_t> datasetA_match_delta_r(datasetA_num_objects), datasetB_match_delta_r(datasetB_num_objects);
+        compute_delta_r_matches(test_case.datasetA_pt.data(), test_case.datasetA_eta.data(), test_case.datasetA_phi.data(), datasetA_num_objects,
+                                test_case.datasetB_pt.data(), test_case.datasetB_eta.data(), test_case.datasetB_phi.data(), datasetB_num_objects,
+                                test_case.rule, delta_r2.data(), datasetA_match_idx.data(), datasetA_match_delta_r.data(), datasetB_match_idx.data(), datasetB_match_delta_r.data());
+        auto is_close = [](const std::vector<Float_t>& values, const std::vector<Float_t>& expected_values){
+            return std::equal(values.begin(), values.end(), expected_values.begin(), expected_values.end(), [](Float_t value, Float_t expected_value){ return std::fabs(value - expected_value) < 1e-4; });
+        };
+        bool is_passed = (datasetA_match_idx == test_case.datasetA_match_idx) && (datasetB_match_idx == test_case.datasetB_match_idx)
+                         && is_close(datasetA_match_delta_r, test_case.datasetA_match_delta_r) && is_close(datasetB_match_delta_r, test_case.datasetB_match_delta_r);
+        if (!is_passed) num_failed++;
+        std::cout << std::format("Delta R matching, {}: {}", test_case.name, is_passed ? "passed" : "failed") << std::endl;
+    }
+    return num_failed == 0;
+}
+#endif
+
+void deallocate_branch_memory(TTree *dst_tree, std::unordered_map<std::string, void*>& data_addresses){
+    // free memory allocated by append_branches_from_tree, source trees must not point to it anymore
+    TObjArray* dst_branches = dst_tree->GetListOfBranches();
+    Int_t num_dst_branches = dst_branches->GetEntriesFast();
+    for (Int_t i_dst_branch = 0; i_dst_branch < num_dst_branches; ++i_dst_branch) {
+        TBranch* dst_branch = (TBranch*)(dst_branches->At(i_dst_branch));
+        auto it = data_addresses.find(std::string(dst_branch->GetName()));
+        if (it == data_addresses.end()) continue;
+        TLeaf* dst_leaf = (TLeaf*)(dst_branch->GetListOfLeaves()->At(0));
+        deallocate_memory_from_leaf(dst_leaf->GetTypeName(), it->second);
+        data_addresses.erase(it);
+    }
+}
+
+// library implementation
+
+event_matcher::event_matcher(const std::string& datasetA_filelist_filename, const std::string& datasetB_filelist_filename,
+                             const std::string& datasetA_branchname_prefix, const std::string& datasetB_branchname_prefix)
+    : datasetA_branchname_prefix(datasetA_branchname_prefix), datasetB_branchname_prefix(datasetB_branchname_prefix) {
+    int datasetA_num_files = 0;
+    int datasetB_num_files = 0;
+    std::vector<file_metadata> datasetA_files, datasetB_files;
+    build_input_chains(datasetA_filelist_filename, datasetB_filelist_filename, datasetA_chain, datasetB_chain, datasetA_num_files, datasetB_num_files, datasetA_counter_maxima, datasetB_counter_maxima, &datasetA_files, &datasetB_files);
+
+    // choose the indexed chain, events are streamed in probe order
+    is_swapped = plan_matching(datasetA_chain, datasetB_chain, datasetA_files, datasetB_files, false).is_swapped;
+    TChain *short_chain = is_swapped ? datasetB_chain : datasetA_chain;
+    if (verbose >= 1) std::cout << "Start building lookup indices with " << short_chain->GetEntries() << " entries..." << std::endl;
+    if (use_compact_index){
+        short_chain_index = std::make_unique<event_index>();
+        short_chain_index->build(short_chain);
+    } else {
+        short_chain->BuildIndex("run", "event");
+    }
+    if (verbose >= 1) std::cout << "Finish building lookup indices..." << std::endl;
+}
+
+event_matcher::~event_matcher(){
+    delete datasetA_chain;
+    delete datasetB_chain;
+}
+
+Long64_t event_matcher::for_each_match(const std::function<void(Long64_t datasetA_entry, Long64_t datasetB_entry)>& callback){
+    TChain *short_chain = is_swapped ? datasetB_chain : datasetA_chain;
+    TChain *long_chain = is_swapped ? datasetA_chain : datasetB_chain;
+
+    TTreeReader long_chain_reader(long_chain);
+    TTreeReaderValue<UInt_t> long_chain_run(long_chain_reader, "run");
+    TTreeReaderValue<ULong64_t> long_chain_event_number(long_chain_reader, "event");
+    TTreeReader short_chain_reader(short_chain);
+
+    event_filter long_chain_filter, short_chain_filter, joined_chain_filter;
+    build_event_filters(long_chain_reader, short_chain_reader, is_swapped, long_chain_filter, short_chain_filter, joined_chain_filter);
+
+    Long64_t num_match = 0;
+    while (long_chain_reader.Next()) {
+        Long64_t i_long_chain = long_chain_reader.GetCurrentEntry();
+        Long64_t i_short_chain = get_entry_number_with_index(short_chain, short_chain_index.get(), *long_chain_run, *long_chain_event_number);
+        if (i_short_chain == -1) continue;
+
+        short_chain_reader.SetEntry(i_short_chain);
+        if (!pass_event_filters(long_chain_filter, short_chain_filter, joined_chain_filter)) continue;
+
+        num_match++;
+        if (is_swapped) callback(i_long_chain, i_short_chain);
+        else callback(i_short_chain, i_long_chain);
+    }
+    return num_match;
+}
+
+Long64_t event_matcher::for_each_matched_event(const std::function<void(const std::unordered_map<std::string, void*>& data_addresses)>& callback){
+    // buffers are allocated the same way as for merged output, the holding tree is never filled
+    TTree buffer_tree("matched_event_buffers", "matched_event_buffers");
+    std::unordered_map<std::string, void*> data_addresses;
+    append_branches_from_tree(datasetA_chain, &buffer_tree, data_addresses, datasetA_branchname_prefix, &datasetA_counter_maxima);
+    append_branches_from_tree(datasetB_chain, &buffer_tree, data_addresses, datasetB_branchname_prefix, &datasetB_counter_maxima);
+    Int_t datasetA_saved_tree_number = datasetA_chain->GetTreeNumber();
+    Int_t datasetB_saved_tree_number = datasetB_chain->GetTreeNumber();
+
+    Long64_t num_match = for_each_match([&](Long64_t datasetA_entry, Long64_t datasetB_entry){
+        // load trees first, we might need to re-allocate memory
+        datasetA_chain->LoadTree(datasetA_entry);
+        datasetB_chain->LoadTree(datasetB_entry);
+        if (datasetA_chain->GetTreeNumber() != datasetA_saved_tree_number){
+            reallocate_memory_if_any(datasetA_chain, &buffer_tree, data_addresses, datasetA_branchname_prefix);
+            datasetA_saved_tree_number = datasetA_chain->GetTreeNumber();
+        }
+        if (datasetB_chain->GetTreeNumber() != datasetB_saved_tree_number){
+            reallocate_memory_if_any(datasetB_chain, &buffer_tree, data_addresses, datasetB_branchname_prefix);
+            datasetB_saved_tree_number = datasetB_chain->GetTreeNumber();
+        }
+
+        datasetA_chain->GetEntry(datasetA_entry);
+        datasetB_chain->GetEntry(datasetB_entry);
+        callback(data_addresses);
+    });
+
+    datasetA_chain->ResetBranchAddresses();
+    datasetB_chain->ResetBranchAddresses();
+    deallocate_branch_memory(&buffer_tree, data_addresses);
+    return num_match;
+}
+
+// column readers for matched_event_data_source, values are owned by the slot readers
+template <typename T>
+class matched_event_value_reader final : public ROOT::Detail::RDF::RColumnReaderBase {
+public:
+    matched_event_value_reader(TTreeReaderValue<T> *value) : value(value) {}
+private:
+    TTreeReaderValue<T> *value;
+    void *GetImpl(Long64_t) final { return value->Get(); }
+};
+
+template <typename T>
+class matched_event_array_reader final : public ROOT::Detail::RDF::RColumnReaderBase {
+public:
+    matched_event_array_reader(TTreeReaderArray<T> *array) : array(array) {}
+private:
+    TTreeReaderArray<T> *array;
+    ROOT::RVec<T> rvec;
+    void *GetImpl(Long64_t) final {
+        // view into the reader memory when contiguous, copy otherwise
+        std::size_t size = array->GetSize();
+        if ((size > 0) && array->IsContiguous()){
+            ROOT::RVec<T> view(&(*array)[0], size);
+            std::swap(rvec, view);
+        } else {
+            ROOT::RVec<T> copy(array->begin(), array->end());
+            std::swap(rvec, copy);
+        }
+        return &rvec;
+    }
+};
+
+template <typename T>
+std::unique_ptr<ROOT::Detail::RDF::RColumnReaderBase> make_matched_event_column_reader(TTreeReader& reader, const std::string& src_branch_name, bool is_array, std::unique_ptr<ROOT::Internal::TTreeReaderValueBase>& value){
+    if (is_array){
+        if (!value) value = std::make_unique<TTreeReaderArray<T>>(reader, src_branch_name.c_str());
+        return std::make_unique<matched_event_array_reader<T>>(static_cast<TTreeReaderArray<T>*>(value.get()));
+    }
+    if (!value) value = std::make_unique<TTreeReaderValue<T>>(reader, src_branch_name.c_str());
+    return std::make_unique<matched_event_value_reader<T>>(static_cast<TTreeReaderValue<T>*>(value.get()));
+}
+
+matched_event_data_source::matched_event_data_source(const std::string& datasetA_filelist_filename, const std::string& datasetB_filelist_filename,
+                                                     const std::string& datasetA_branchname_prefix, const std::string& datasetB_branchname_prefix)
+    : matcher(datasetA_filelist_filename, datasetB_filelist_filename, datasetA_branchname_prefix, datasetB_branchname_prefix) {
+    add_columns(matcher.get_datasetA_chain(), datasetA_branchname_prefix, true);
+    add_columns(matcher.get_datasetB_chain(), datasetB_branchname_prefix, false);
+}
+
+matched_event_data_source::~matched_event_data_source(){
+    for (auto& slot : slots){
+        slot.column_values.clear(); // before their readers
+        slot.datasetA_reader.reset();
+        slot.datasetB_reader.reset();
+        delete slot.datasetA_chain;
+        delete slot.datasetB_chain;
+    }
+}
+
+void matched_event_data_source::add_columns(TChain *chain, const std::string& prefix, bool is_datasetA){
+    chain->LoadTree(0);
+    TObjArray* src_branches = chain->GetTree()->GetListOfBranches();
+    Int_t num_src_branches = src_branches->GetEntriesFast();
+    for (Int_t i_src_branch = 0; i_src_branch < num_src_branches; ++i_src_branch) {
+        TBranch* src_branch = (TBranch*)(src_branches->At(i_src_branch));
+        TLeaf* src_leaf = (TLeaf*) src_branch->GetListOfLeaves()->At(0);
+        std::string column_name = get_dst_branch_name(src_branch->GetName(), prefix);
+        column_names.push_back(column_name);
+        // Float16_t and Double32_t are only compressed on disk, they are Float_t and Double_t in memory as in allocate_memory_from_leaf
+        std::string leaf_type_name = src_leaf->GetTypeName();
+        if (leaf_type_name == "Float16_t") leaf_type_name = "Float_t";
+        else if (leaf_type_name == "Double32_t") leaf_type_name = "Double_t";
+        columns[column_name] = column_info{is_datasetA, src_branch->GetName(), leaf_type_name, src_leaf->GetLeafCount() != nullptr};
+    }
+}
+
+void matched_event_data_source::SetNSlots(unsigned int num_slots){
+    // each slot reads from its own chains, file lists and entry counts are copied from the matcher
+    slots.resize(num_slots);
+    for (auto& slot : slots){
+        slot.datasetA_chain = new TChain("Events");
+        slot.datasetA_chain->Add(matcher.get_datasetA_chain());
+        slot.datasetB_chain = new TChain("Events");
+        slot.datasetB_chain->Add(matcher.get_datasetB_chain());
+        slot.datasetA_reader = std::make_unique<TTreeReader>(slot.datasetA_chain);
+        slot.datasetB_reader = std::make_unique<TTreeReader>(slot.datasetB_chain);
+    }
+}
+
+const std::vector<std::string>& matched_event_data_source::GetColumnNames() const {
+    return column_names;
+}
+
+bool matched_event_data_source::HasColumn(std::string_view column_name) const {
+    return columns.find(std::string(column_name)) != columns.end();
+}
+
+std::string matched_event_data_source::GetTypeName(std::string_view column_name) const {
+    const column_info& column = columns.at(std::string(column_name));
+    if (column.is_array) return "ROOT::VecOps::RVec<" + column.leaf_type_name + ">";
+    return column.leaf_type_name;
+}
+
+void matched_event_data_source::Initialize(){
+    // key-only pass, entries of this data source are matched pairs
+    has_served_entry_ranges = false;
+    if (!matched_entries.empty()) return;
+    matcher.for_each_match([&](Long64_t datasetA_entry, Long64_t datasetB_entry){
+        matched_entries.emplace_back(datasetA_entry, datasetB_entry);
+    });
+}
+
+std::vector<std::pair<ULong64_t, ULong64_t>> matched_event_data_source::GetEntryRanges(){
+    // everything is served in the first call, a few ranges per slot for load balancing
+    std::vector<std::pair<ULong64_t, ULong64_t>> entry_ranges;
+    if (has_served_entry_ranges) return entry_ranges;
+    has_served_entry_ranges = true;
+
+    ULong64_t num_entries = matched_entries.size();
+    ULong64_t num_ranges = std::max<ULong64_t>(1, std::min<ULong64_t>(num_entries, 4 * slots.size()));
+    for (ULong64_t i_range = 0; i_range < num_ranges; ++i_range){
+        ULong64_t start = num_entries * i_range / num_ranges;
+        ULong64_t end = num_entries * (i_range + 1) / num_ranges;
+        if (end > start) entry_ranges.emplace_back(start, end);
+    }
+    return entry_ranges;
+}
+
+bool matched_event_data_source::SetEntry(unsigned int slot, ULong64_t entry){
+    slots[slot].datasetA_reader->SetEntry(matched_entries[entry].first);
+    slots[slot].datasetB_reader->SetEntry(matched_entries[entry].second);
+    return true;
+}
+
+std::string matched_event_data_source::GetLabel(){
+    return "NanoAODMatching";
+}
+
+std::unique_ptr<ROOT::Detail::RDF::RColumnReaderBase> matched_event_data_source::GetColumnReaders(unsigned int slot, std::string_view column_name, const std::type_info&){
+    const column_info& column = columns.at(std::string(column_name));
+    slot_state& state = slots[slot];
+    TTreeReader& reader = column.is_datasetA ? *state.datasetA_reader : *state.datasetB_reader;
+    std::unique_ptr<ROOT::Internal::TTreeReaderValueBase>& value = state.column_values[std::string(column_name)];
+    const char* leaf_type_name = column.leaf_type_name.c_str();
+
+    if (std::strcmp("Char_t", leaf_type_name) == 0)
+        return make_matched_event_column_reader<Char_t>(reader, column.src_branch_name, column.is_array, value);
+    else if (std::strcmp("UChar_t", leaf_type_name) == 0)
+        return make_matched_event_column_reader<UChar_t>(reader, column.src_branch_name, column.is_array, value);
+    else if (std::strcmp("Short_t", leaf_type_name) == 0)
+        return make_matched_event_column_reader<Short_t>(reader, column.src_branch_name, column.is_array, value);
+    else if (std::strcmp("UShort_t", leaf_type_name) == 0)
+        return make_matched_event_column_reader<UShort_t>(reader, column.src_branch_name, column.is_array, value);
+    else if (std::strcmp("Int_t", leaf_type_name) == 0)
+        return make_matched_event_column_reader<Int_t>(reader, column.src_branch_name, column.is_array, value);
+    else if (std::strcmp("UInt_t", leaf_type_name) == 0)
+        return make_matched_event_column_reader<UInt_t>(reader, column.src_branch_name, column.is_array, value);
+    else if (std::strcmp("Float_t", leaf_type_name) == 0)
+        return make_matched_event_column_reader<Float_t>(reader, column.src_branch_name, column.is_array, value);
+    else if (std::strcmp("Double_t", leaf_type_name) == 0)
+        return make_matched_event_column_reader<Double_t>(reader, column.src_branch_name, column.is_array, value);
+    else if (std::strcmp("Long64_t", leaf_type_name) == 0)
+        return make_matched_event_column_reader<Long64_t>(reader, column.src_branch_name, column.is_array, value);
+    else if (std::strcmp("ULong64_t", leaf_type_name) == 0)
+        return make_matched_event_column_reader<ULong64_t>(reader, column.src_branch_name, column.is_array, value);
+    else if (std::strcmp("Long_t", leaf_type_name) == 0)
+        return make_matched_event_column_reader<Long_t>(reader, column.src_branch_name, column.is_array, value);
+    else if (std::strcmp("ULong_t", leaf_type_name) == 0)
+        return make_matched_event_column_reader<ULong_t>(reader, column.src_branch_name, column.is_array, value);
+    else if (std::strcmp("Bool_t", leaf_type_name) == 0)
+        return make_matched_event_column_reader<Bool_t>(reader, column.src_branch_name, column.is_array, value);
+    throw std::runtime_error("matched_event_data_source: unsupported type " + column.leaf_type_name + " for column " + std::string(column_name));
+}
+
+matched_event_data_source::Record_t matched_event_data_source::GetColumnReadersImpl(std::string_view, const std::type_info&){
+    // readers are provided per slot by GetColumnReaders
+    return {};
+}
+
+ROOT::RDataFrame make_matched_event_data_frame(const std::string& datasetA_filelist_filename, const std::string& datasetB_filelist_filename,
+                                               const std::string& datasetA_branchname_prefix, const std::string& datasetB_branchname_prefix){
+    return ROOT::RDataFrame(std::make_unique<matched_event_data_source>(datasetA_filelist_filename, datasetB_filelist_filename, datasetA_branchname_prefix, datasetB_branchname_prefix));
+}
+
+file_stager::file_stager(TChain *chain, const std::string& staging_subdirectory, bool is_sequential, const std::vector<file_metadata>& files_metadata)
+    : chain(chain), is_sequential(is_sequential) {
+    // one directory per process and chain, so concurrent jobs do not share staged files
+    staging_path = std::format("{}/{}/{}", staging_directory, getpid(), staging_subdirectory);
+    std::filesystem::create_directories(staging_path);
+
+    // source sizes from the startup scan
+    std::unordered_map<std::string, Long64_t> file_sizes;
+    for (const auto& metadata : files_metadata) file_sizes[metadata.filename] = metadata.file_size;
+
+    TObjArray* elements = chain->GetListOfFiles();
+    for (Int_t i_element = 0; i_element < elements->GetEntriesFast(); ++i_element){
+        staged_file file;
+        file.original_path = elements->At(i_element)->GetTitle();
+        auto it = file_sizes.find(file.original_path);
+        if (it != file_sizes.end()) file.expected_size = it->second;
+        file.staged_path = std::format("{}/{}_{}", staging_path, i_element, std::filesystem::path(file.original_path).filename().string());
+        files.push_back(file);
+    }
+
+    ROOT::EnableThreadSafety();
+    for (int i_worker = 0; i_worker < staging_num_threads; ++i_worker)
+        workers.emplace_back(&file_stager::copy_worker, this);
+}
+
+file_stager::~file_stager(){
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        is_stopping = true;
+    }
+    condition.notify_all();
+    for (auto& worker : workers) worker.join();
+
+    // point the chain back to the original files and clean up
+    for (Int_t i_file = 0; i_file < Int_t(files.size()); ++i_file){
+        if (files[i_file].status == stage_status::kReady) evict(i_file);
+    }
+    std::error_code error;
+    std::filesystem::remove_all(staging_path, error);
+    std::filesystem::remove(std::filesystem::path(staging_path).parent_path(), error); // only if no other chain uses it
+}
+
+void file_stager::update(Int_t tree_number){
+    // fast path, nothing changed since the last call
+    if ((tree_number == current_tree_number) && !has_finished_copies.load(std::memory_order_relaxed)) return;
+
+    // the sequential chain only moves forward, an earlier tree must not reschedule files already dropped
+    if (is_sequential && (tree_number < current_tree_number)) return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    has_finished_copies = false;
+    bool is_new_tree = (tree_number != current_tree_number);
+    current_tree_number = tree_number;
+    if ((tree_number < 0) || (tree_number >= Int_t(files.size()))) return;
+    files[tree_number].last_used = ++num_updates;
+
+    // finished copies take effect the next time the chain opens them
+    TObjArray* elements = chain->GetListOfFiles();
+    for (Int_t i_file = 0; i_file < Int_t(files.size()); ++i_file){
+        if ((files[i_file].status == stage_status::kReady) && !files[i_file].is_redirected){
+            elements->At(i_file)->SetTitle(files[i_file].staged_path.c_str());
+            files[i_file].is_redirected = true;
+        }
+    }
+
+    if (is_sequential){
+        // files behind are done, drop pending copies and staged copies
+        for (Int_t i_file = 0; i_file < tree_number; ++i_file){
+            if (files[i_file].status == stage_status::kQueued){
+                queue.erase(std::remove(queue.begin(), queue.end(), i_file), queue.end());
+                staged_size -= files[i_file].size;
+                files[i_file].size = 0;
+                files[i_file].status = stage_status::kNotStaged;
+            } else if (files[i_file].status == stage_status::kReady){
+                evict(i_file);
+            }
+        }
+        // stage the next files, stop when the budget is used up
+        for (Int_t i_file = tree_number + 1; i_file <= std::min<Int_t>(tree_number + staging_num_files_ahead, files.size() - 1); ++i_file){
+            if ((files[i_file].status == stage_status::kNotStaged) && !schedule(i_file)) break;
+        }
+    } else if (is_new_tree && (files[tree_number].status == stage_status::kNotStaged)){
+        // stage on first use, later visits of this file are local
+        schedule(tree_number);
+    }
+    condition.notify_all();
+}
+
+bool file_stager::schedule(Int_t tree_number){
+    // reserve the source size for the copy, evicting least recently used staged files if random access
+    staged_file& file = files[tree_number];
+    if (file.expected_size <= 0){
+        // not scanned at startup, only the file header is read
+        std::unique_ptr<TFile> source(TFile::Open(file.original_path.c_str(), "READ"));
+        file.expected_size = (source && !source->IsZombie()) ? source->GetSize() : 0;
+        if (file.expected_size <= 0){
+            file.status = stage_status::kFailed; // read from the source
+            return true;
+        }
+    }
+    Long64_t reserved_size = file.expected_size;
+    while (staged_size + reserved_size > staging_max_size){
+        if (is_sequential) return false;
+        Int_t i_evict = -1;
+        for (Int_t i_file = 0; i_file < Int_t(files.size()); ++i_file){
+            if ((files[i_file].status != stage_status::kReady) || (i_file == current_tree_number)) continue;
+            if ((i_evict == -1) || (files[i_file].last_used < files[i_evict].last_used)) i_evict = i_file;
+        }
+        if (i_evict == -1) return false;
+        evict(i_evict);
+    }
+    staged_size += reserved_size;
+    file.size = reserved_size;
+    file.status = stage_status::kQueued;
+    queue.push_back(tree_number);
+    return true;
+}
+
+void file_stager::evict(Int_t tree_number){
+    // mutex must be held
+    staged_file& file = files[tree_number];
+    if (file.is_redirected) chain->GetListOfFiles()->At(tree_number)->SetTitle(file.original_path.c_str());
+    std::error_code error;
+    std::filesystem::remove(file.staged_path, error);
+    staged_size -= file.size;
+    file.size = 0;
+    file.is_redirected = false;
+    file.status = stage_status::kNotStaged;
+}
+
+void file_stager::copy_worker(){
+    while (true){
+        Int_t tree_number;
+        std::string original_path, staged_path;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this](){ return is_stopping || !queue.empty(); });
+            if (is_stopping) return;
+            tree_number = queue.front();
+            queue.pop_front();
+            files[tree_number].status = stage_status::kCopying;
+            original_path = files[tree_number].original_path;
+            staged_path = files[tree_number].staged_path;
+        }
+
+        // copy to a temporary name, so a staged file is always complete
+        std::string partial_path = staged_path + ".part";
+        std::error_code error;
+        bool is_copied = TFile::Cp(original_path.c_str(), partial_path.c_str(), kFALSE);
+        if (is_copied) std::filesystem::rename(partial_path, staged_path, error);
+        is_copied = is_copied && !error;
+        Long64_t size = is_copied ? Long64_t(std::filesystem::file_size(staged_path, error)) : 0;
+        if (!is_copied) std::filesystem::remove(partial_path, error);
+        if (verbose >= 3) std::cout << (is_copied ? "Staged " : "Failed to stage ") << original_path << std::endl;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            staged_file& file = files[tree_number];
+            staged_size += size - file.size;
+            file.size = size;
+            file.status = is_copied ? stage_status::kReady : stage_status::kFailed;
+        }
+        has_finished_copies = true;
+    }
+}
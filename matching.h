@@ -0,0 +1,127 @@
+#ifndef NANOAOD_MATCHING_H
+#define NANOAOD_MATCHING_H
+
+// nanoAOD matching as a library
+// build matching.cpp with -DNANOAOD_MATCHING_NO_MAIN (see libmatching.so in Makefile) and include this header
+
+// c++ libraries include
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <typeinfo>
+
+// ROOT libraries include
+#include "TChain.h"
+#include "TTreeReader.h"
+#include "TTreeReaderValue.h"
+#include "TTreeReaderArray.h"
+#include "ROOT/RDataSource.hxx"
+#include "ROOT/RDataFrame.hxx"
+
+// event filters, see matching.cpp for details
+using event_filter = std::function<bool()>;
+using event_filter_builder = std::function<event_filter(TTreeReader& reader)>;
+using joined_event_filter_builder = std::function<event_filter(TTreeReader& datasetA_reader, TTreeReader& datasetB_reader)>;
+extern event_filter_builder datasetA_filter;
+extern event_filter_builder datasetB_filter;
+extern joined_event_filter_builder joined_filter;
+
+// engine parameters, see matching.cpp for details, set them before constructing event_matcher
+extern int startup_num_threads;
+extern bool prune_files_without_run_overlap;
+extern bool use_compact_index;
+extern int compact_index_block_size;
+extern bool use_cost_based_planner;
+extern Long64_t planner_sample_size;
+
+extern int verbose; // 0 for no output, per-branch lines from 3
+
+class event_index;
+
+// matching engine, builds both chains and the lookup index once, then streams matches to callbacks
+// the indexed dataset is chosen by the cost-based planner, as in the command line tool
+class event_matcher {
+public:
+    event_matcher(const std::string& datasetA_filelist_filename, const std::string& datasetB_filelist_filename,
+                  const std::string& datasetA_branchname_prefix = "1.", const std::string& datasetB_branchname_prefix = "2.");
+    ~event_matcher();
+    event_matcher(const event_matcher&) = delete;
+    event_matcher& operator=(const event_matcher&) = delete;
+
+    // stream matched (datasetA entry, datasetB entry) pairs, only run, event and filter branches are read
+    Long64_t for_each_match(const std::function<void(Long64_t datasetA_entry, Long64_t datasetB_entry)>& callback);
+
+    // stream matched events with all active branches read, buffers are keyed by prefixed branch name as in merged output
+    // e.g. (Float_t*)data_addresses.at("1.Jet_pt"), select branches with SetBranchStatus on the chains beforehand
+    Long64_t for_each_matched_event(const std::function<void(const std::unordered_map<std::string, void*>& data_addresses)>& callback);
+
+    TChain* get_datasetA_chain() const { return datasetA_chain; }
+    TChain* get_datasetB_chain() const { return datasetB_chain; }
+    const std::string& get_datasetA_branchname_prefix() const { return datasetA_branchname_prefix; }
+    const std::string& get_datasetB_branchname_prefix() const { return datasetB_branchname_prefix; }
+
+private:
+    TChain *datasetA_chain;
+    TChain *datasetB_chain;
+    std::string datasetA_branchname_prefix;
+    std::string datasetB_branchname_prefix;
+    std::unordered_map<std::string, Int_t> datasetA_counter_maxima; // over all files, from the startup scan
+    std::unordered_map<std::string, Int_t> datasetB_counter_maxima;
+    bool is_swapped; // datasetA is the long chain
+    std::unique_ptr<event_index> short_chain_index; // compact index, nullptr for the TChainIndex
+};
+
+// RDataFrame data source over matched events, columns are prefixed branch names of both datasets
+// arrays are exposed as ROOT::RVec, columns are read lazily from per-slot chains only when used
+class matched_event_data_source final : public ROOT::RDF::RDataSource {
+public:
+    matched_event_data_source(const std::string& datasetA_filelist_filename, const std::string& datasetB_filelist_filename,
+                              const std::string& datasetA_branchname_prefix = "1.", const std::string& datasetB_branchname_prefix = "2.");
+    ~matched_event_data_source();
+
+    void SetNSlots(unsigned int num_slots) final;
+    const std::vector<std::string>& GetColumnNames() const final;
+    bool HasColumn(std::string_view column_name) const final;
+    std::string GetTypeName(std::string_view column_name) const final;
+    std::vector<std::pair<ULong64_t, ULong64_t>> GetEntryRanges() final;
+    bool SetEntry(unsigned int slot, ULong64_t entry) final;
+    void Initialize() final;
+    std::string GetLabel() final;
+    std::unique_ptr<ROOT::Detail::RDF::RColumnReaderBase> GetColumnReaders(unsigned int slot, std::string_view column_name, const std::type_info& type) final;
+
+protected:
+    Record_t GetColumnReadersImpl(std::string_view column_name, const std::type_info& type) final;
+
+private:
+    struct column_info {
+        bool is_datasetA;
+        std::string src_branch_name;
+        std::string leaf_type_name;
+        bool is_array;
+    };
+    struct slot_state {
+        TChain *datasetA_chain;
+        TChain *datasetB_chain;
+        std::unique_ptr<TTreeReader> datasetA_reader;
+        std::unique_ptr<TTreeReader> datasetB_reader;
+        std::unordered_map<std::string, std::unique_ptr<ROOT::Internal::TTreeReaderValueBase>> column_values; // created once per column
+    };
+
+    event_matcher matcher;
+    std::vector<std::pair<Long64_t, Long64_t>> matched_entries; // (datasetA entry, datasetB entry)
+    std::vector<std::string> column_names;
+    std::unordered_map<std::string, column_info> columns;
+    std::vector<slot_state> slots;
+    bool has_served_entry_ranges = false;
+
+    void add_columns(TChain *chain, const std::string& prefix, bool is_datasetA);
+};
+
+// RDataFrame over matched events, e.g. make_matched_event_data_frame("filelist1.txt", "filelist2.txt").Filter(...)
+ROOT::RDataFrame make_matched_event_data_frame(const std::string& datasetA_filelist_filename, const std::string& datasetB_filelist_filename,
+                                               const std::string& datasetA_branchname_prefix = "1.", const std::string& datasetB_branchname_prefix = "2.");
+
+#endif